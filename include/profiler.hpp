@@ -15,9 +15,24 @@
 
 #ifdef TRACY_ENABLE
 
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
 #include <limits>
 #include <mutex>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Highest profile level compiled in. Profile points of higher levels compile
+// to nothing, whatever the runtime level is.
+#ifndef PROF_COMPILE_LEVEL
+#define PROF_COMPILE_LEVEL 0xffffffff
+#endif
 
 namespace _profiler {
 
@@ -29,16 +44,49 @@ enum ProfileLevel : uint32_t {
     PROF_LVL_ALL = 0xffffffff,
 };
 
-inline uint32_t getProfileLevel() {
-    static uint32_t prof_lvl = PROF_LVL_USER;
-    static std::once_flag Flag{};
-    std::call_once(Flag, []() {
-        if (char *env_str = getenv("GP_PROFILE_LEVEL"))
-            prof_lvl = std::stoul(env_str, nullptr, 16);
-    });
+/// Runtime profile level, read from GP_PROFILE_LEVEL at startup.
+inline std::atomic<uint32_t> profile_level{PROF_LVL_USER};
 
-    return prof_lvl;
-}
+inline uint32_t getProfileLevel() { return profile_level.load(std::memory_order_relaxed); }
+
+/// Change the runtime profile level.
+inline void setProfileLevel(uint32_t prof_lvl) { profile_level.store(prof_lvl, std::memory_order_relaxed); }
+
+/// Whether profile points of \p prof_lvl are compiled in.
+constexpr bool isCompiledLevel(uint32_t prof_lvl) { return prof_lvl <= uint32_t(PROF_COMPILE_LEVEL); }
+
+/// Whether profile points of \p prof_lvl are collected at runtime.
+inline bool isLevelEnabled(uint32_t prof_lvl) { return getProfileLevel() >= prof_lvl; }
+
+/// Static description of a profile point call site.
+///
+/// Descriptors are created once per call site by the usage macros and
+/// registered on first use, so recording a profile point only stores the
+/// returned ZoneId. Names are resolved back from the id at dump time.
+struct ZoneDescriptor {
+    const char *name; // Timeline label
+    const char *file; // Source file of the call site
+    uint32_t line;    // Source line of the call site
+    uint32_t level;   // Profile level of the call site
+};
+
+/// Small integer identifying a registered ZoneDescriptor.
+using ZoneId = uint32_t;
+
+/// Register a static zone descriptor.
+///
+/// \param zone descriptor with static storage duration.
+/// \returns the id used to record profile points of this zone.
+ZoneId registerZone(const ZoneDescriptor *zone);
+
+/// Register a zone whose name is only known at runtime.
+///
+/// Names are interned, so calling it again with the same name returns the same
+/// id. It takes a lock and should be kept out of hot paths.
+///
+/// \param name of the zone.
+/// \returns the id used to record profile points of this zone.
+ZoneId internZone(const std::string &name);
 
 /// Initialize the profiler global context for the current process.
 ///
@@ -57,9 +105,99 @@ void initThreadProfiler(std::string &&thread_name = "", int index = std::numeric
 /// The new profiler point is added to the top of the local thread context stack
 /// and it must be ended by calling endProfilePoint().
 ///
+/// \param zone id returned by registerZone() or internZone().
+void beginProfilePoint(ZoneId zone);
+
+/// Begin a profile point with details.
+///
+/// The details are copied into the buffer of the calling thread, truncated to
+/// 16 KB.
+///
+/// \param zone id returned by registerZone() or internZone().
+/// \param details of the current profile point in a stringified JSON format.
+void beginProfilePoint(ZoneId zone, const std::string &&details);
+
+/// Type of a typed argument of a profile point.
+enum class ArgType : uint32_t {
+    int64 = 0,   // Signed integers and enums
+    uint64 = 1,  // Unsigned integers and enums
+    float64 = 2, // Floating point numbers
+    boolean = 3, // Booleans
+    string = 4,  // Strings, truncated to 60 bytes
+};
+
+/// Typed argument of a profile point.
+struct ZoneArg {
+    std::string_view key;          // Name of the argument, truncated to 60 bytes
+    ArgType type = ArgType::int64; // Type of the value
+    uint64_t bits = 0;             // Value of the numeric types
+    std::string_view text;         // Value of the string type
+};
+
+/// Make the typed argument \p key of a profile point, holding \p value.
+///
+/// Integers, enums, floating point numbers, booleans and strings are
+/// supported. The key and strings are referenced, not copied.
+template <typename Value>
+ZoneArg makeZoneArg(std::string_view key, const Value &value) {
+    if constexpr (std::is_enum_v<Value>) {
+        return makeZoneArg(key, static_cast<std::underlying_type_t<Value>>(value));
+    } else if constexpr (std::is_same_v<Value, bool>) {
+        return ZoneArg{key, ArgType::boolean, value, {}};
+    } else if constexpr (std::is_integral_v<Value> && std::is_signed_v<Value>) {
+        return ZoneArg{key, ArgType::int64, static_cast<uint64_t>(static_cast<int64_t>(value)), {}};
+    } else if constexpr (std::is_integral_v<Value>) {
+        return ZoneArg{key, ArgType::uint64, static_cast<uint64_t>(value), {}};
+    } else if constexpr (std::is_floating_point_v<Value>) {
+        return ZoneArg{key, ArgType::float64, std::bit_cast<uint64_t>(static_cast<double>(value)), {}};
+    } else {
+        static_assert(std::is_convertible_v<const Value &, std::string_view>, "unsupported profile point argument type");
+        return ZoneArg{key, ArgType::string, 0, std::string_view(value)};
+    }
+}
+
+/// Begin a profile point with typed arguments.
+///
+/// The arguments, keys included, are copied into the buffer of the calling
+/// thread as compact fixed-size records, and only formatted into the trace
+/// args when it is dumped. Up to 16 arguments are recorded.
+///
+/// \param zone id returned by registerZone() or internZone().
+/// \param args of the profile point.
+/// \param count of \p args.
+void beginProfilePoint(ZoneId zone, const ZoneArg *args, size_t count);
+
+inline void fillZoneArgs(ZoneArg *) {}
+
+/// Fill \p args from key, value pairs.
+template <size_t N, typename Value, typename... Rest>
+void fillZoneArgs(ZoneArg *args, const char (&key)[N], const Value &value, const Rest &...rest) {
+    *args = makeZoneArg(key, value);
+    fillZoneArgs(args + 1, rest...);
+}
+
+/// Begin a profile point with typed arguments given as key, value pairs.
+///
+/// \param zone id returned by registerZone() or internZone().
+/// \param key naming the first argument.
+/// \param value of the first argument, see makeZoneArg().
+/// \param rest following keys and values.
+template <size_t N, typename Value, typename... Rest>
+void beginProfilePoint(ZoneId zone, const char (&key)[N], const Value &value, const Rest &...rest) {
+    static_assert(sizeof...(Rest) % 2 == 0, "profile point arguments come in key, value pairs");
+    ZoneArg args[1 + sizeof...(Rest) / 2];
+    fillZoneArgs(args, key, value, rest...);
+    beginProfilePoint(zone, args, std::size(args));
+}
+
+/// Begin a profile point with a runtime name.
+///
+/// Slow path that interns \p name through internZone() on every call. Prefer
+/// the usage macros, which register the call site only once.
+///
 /// \param name of the profile point.
 /// \param details of the current profile point in a stringified JSON format.
-void beginProfilePoint(const std::string &&name = "", const std::string &&details = "{}");
+void beginProfilePoint(const std::string &&name, const std::string &&details = "{}");
 
 /// End the most recent profile point.
 ///
@@ -68,15 +206,178 @@ void beginProfilePoint(const std::string &&name = "", const std::string &&detail
 /// beginProfilePoint() call.
 void endProfilePoint();
 
+/// Record a sample of a counter, plotted over time in the timeline.
+///
+/// Samples are fixed-size records stored next to the profile points of the
+/// calling thread, so it is cheap enough to be called very often.
+///
+/// \param counter id returned by registerZone() or internZone(), naming the
+/// counter.
+/// \param value of the counter from now on.
+void recordCounter(ZoneId counter, double value);
+
+/// Part of the timeline marked by an instant event.
+enum class InstantScope : char {
+    thread = 't',  // The thread recording it
+    process = 'p', // Every thread of the process
+    global = 'g',  // The whole trace
+};
+
+/// Record an event without duration, such as a state change.
+///
+/// \param instant id returned by registerZone() or internZone(), naming the
+/// event.
+/// \param scope of the timeline marked by the event.
+void recordInstant(ZoneId instant, InstantScope scope = InstantScope::thread);
+
+/// Mark the end of a frame.
+///
+/// Records a "Frame" instant event on the process and the time since the
+/// previous mark into the frame summary: a histogram of the frame times and
+/// the longest frames with their timestamps, written next to the trace file.
+/// Any thread may mark frames, but usually the one rendering them does.
+void markFrame();
+
+/// Identifier linking the steps of a flow.
+using FlowId = uint64_t;
+
+/// Last flow id given by newFlowId().
+inline std::atomic<FlowId> last_flow_id{0};
+
+/// Generate an id for a new flow, unique within the process.
+inline FlowId newFlowId() { return last_flow_id.fetch_add(1, std::memory_order_relaxed) + 1; }
+
+/// Step of a flow, linking work handed over between threads.
+enum class FlowPhase : char {
+    start = 's', // Where the work is handed over
+    step = 't',  // Where the work goes through
+    end = 'f',   // Where the work is done
+};
+
+/// Record a step of a flow, drawn as an arrow between the profile points
+/// enclosing its steps.
+///
+/// It is attached to the most recent profile point of the calling thread, so
+/// it must be called while one is active.
+///
+/// \param flow id returned by registerZone() or internZone(), naming the flow.
+/// Every step of a flow must use the same name.
+/// \param phase of the step in the flow.
+/// \param id of the flow returned by newFlowId().
+void recordFlow(ZoneId flow, FlowPhase phase, FlowId id);
+
+/// Handle of a span that may end on another thread than the one beginning it.
+struct AsyncSpan {
+    ZoneId name = 0;     // Registered name of the span
+    ZoneId category = 0; // Registered name of its category
+    FlowId id = 0;       // Unique id, 0 if the span is not recorded
+    int64_t start = 0;   // Begin timestamp in clock ticks
+};
+
+/// Begin an async span.
+///
+/// Unlike profile points, async spans do not nest with the other profile
+/// points of the calling thread. Nothing is recorded until the span ends.
+///
+/// \param name id returned by registerZone() or internZone(), naming the span.
+/// \param category id returned by registerZone() or internZone(), naming the
+/// category the span is grouped with.
+/// \returns the handle to pass to endAsyncSpan().
+AsyncSpan beginAsyncSpan(ZoneId name, ZoneId category);
+
+/// End an async span, from any thread.
+///
+/// The whole span is recorded into the buffer of the calling thread, without
+/// any lock.
+///
+/// \param span returned by beginAsyncSpan().
+void endAsyncSpan(const AsyncSpan &span);
+
+/// Attribute a heap allocation to the innermost active profile point of the
+/// calling thread, when GP_ALLOC_TRACKING is set.
+///
+/// Builds defining PROF_TRACK_ALLOCATIONS call it from their replacement of
+/// operator new. Custom allocators may call it as well.
+///
+/// \param bytes allocated.
+void recordAllocation(size_t bytes);
+
+/// Attribute a heap free to the innermost active profile point of the calling
+/// thread, when GP_ALLOC_TRACKING is set.
+///
+/// \param bytes freed, as given to recordAllocation().
+void recordDeallocation(size_t bytes);
+
+/// Memory used to store the completed profile points.
+struct BufferStats {
+    uint64_t entries = 0;     // Completed profile points recorded
+    uint64_t bytes = 0;       // Bytes reserved to store them
+    uint64_t dropped = 0;     // Profile points lost to a full buffer
+    uint64_t overwritten = 0; // Profile points replaced by newer ones
+};
+
+/// Collect the memory statistics of every thread profiler.
+///
+/// Divide `bytes` by `entries` to get the cost of each recorded profile point.
+BufferStats getBufferStats();
+
+/// Collect the memory statistics of the calling thread profiler.
+BufferStats getThreadBufferStats();
+
+/// Timing statistics of a zone, merged across threads, in nanoseconds.
+struct ZoneStatistics {
+    std::string name;    // Zone name
+    uint64_t count = 0;  // Profile points ended
+    double total = 0;    // Sum of their durations
+    double mean = 0;     // Average duration
+    double min = 0;      // Shortest duration
+    double p50 = 0;      // Median duration
+    double p99 = 0;      // 99th percentile
+    double p999 = 0;     // 99.9th percentile
+    double max = 0;      // Longest duration
+    // Time spent on the CPU and off it, descheduled or blocked, summed over the
+    // profile points, with GP_THREAD_CPU_TIME.
+    double cpu_total = 0;
+    double off_cpu_total = 0;
+    // Heap allocations and frees made while the zone was the innermost one,
+    // with GP_ALLOC_TRACKING.
+    uint64_t allocations = 0;
+    uint64_t allocated_bytes = 0;
+    uint64_t frees = 0;
+    uint64_t freed_bytes = 0;
+    // Mean delta of each perf counter per profile point, with GP_PERF_COUNTERS.
+    std::vector<std::pair<std::string, double>> counters;
+};
+
+/// Collect the statistics of every zone while the process runs.
+///
+/// Any thread may call it at any time: instrumented threads are never blocked
+/// and the statistics of each zone are copied consistently, percentiles being
+/// precise to a few percent. Zones are sorted by decreasing total duration.
+/// It is empty unless GP_ZONE_STATS is set.
+std::vector<ZoneStatistics> snapshotStats();
+
 /// Dump the profiler global context into a tracing file.
 ///
 /// \param filename desired for the dumped tracing file.
 void dumpTracingFile();
 
+/// Dump a snapshot of the profiler global context while the process runs.
+///
+/// Writes the completed profile points still held in memory, without
+/// consuming them, and the active ones as unfinished events into a new file
+/// next to the trace file. Instrumented threads are not blocked meanwhile.
+/// With GP_SNAPSHOT_SIGNAL set, SIGUSR1 triggers it as well.
+void dumpTracingSnapshot();
+
 /// Scoped profiler point.
 ///
 /// Helper class that calls beginProfilePoint() at its contruction and
 /// endProfilePoint() at its destruction.
+///
+/// \tparam Level of the profile point. It compiles to nothing when the level
+/// is above PROF_COMPILE_LEVEL.
+template <uint32_t Level>
 struct ScopedProfilePoint {
     // The class is non-copyable and non-movable.
     ScopedProfilePoint() = delete;
@@ -85,6 +386,8 @@ struct ScopedProfilePoint {
     ScopedProfilePoint(ScopedProfilePoint &&) = delete;
     ScopedProfilePoint &operator=(ScopedProfilePoint &&) = delete;
 
+    static constexpr bool compiled = isCompiledLevel(Level);
+
     // Check if the ProfilePoint was started due to the Prof_LVL police
     bool started = false;
     /// Begin the scoped profiler point.
@@ -92,19 +395,45 @@ struct ScopedProfilePoint {
     /// The new profiler point is added to the top of the local thread context
     /// stack and it will be ended at ~ScopedProfilePoint().
     ///
-    /// \param name of the profile point.
+    /// \param zone_fn returns the zone id of the profile point. It is only
+    /// called when the profile point is collected.
+    template <typename ZoneFn>
+    explicit ScopedProfilePoint(ZoneFn zone_fn) {
+        if constexpr (compiled) {
+            if ((started = isLevelEnabled(Level)))
+                beginProfilePoint(zone_fn());
+        }
+    }
+
+    /// \param zone_fn returns the zone id of the profile point.
     /// \param details of the current profile point in a stringified JSON format.
-    ScopedProfilePoint(const ProfileLevel prof_lvl, const std::string &&name, const std::string &&details = "{}") {
-        if ((started = (getProfileLevel() >= prof_lvl)))
-            beginProfilePoint(std::move(name), std::move(details));
+    template <typename ZoneFn, typename Details>
+    ScopedProfilePoint(ZoneFn zone_fn, Details &&details) {
+        if constexpr (compiled) {
+            if ((started = isLevelEnabled(Level)))
+                beginProfilePoint(zone_fn(), std::string(std::forward<Details>(details)));
+        }
+    }
+
+    /// \param zone_fn returns the zone id of the profile point.
+    /// \param key naming the first typed argument.
+    /// \param value of the first argument, then the following keys and values.
+    template <typename ZoneFn, size_t N, typename Value, typename... Rest>
+    ScopedProfilePoint(ZoneFn zone_fn, const char (&key)[N], const Value &value, const Rest &...rest) {
+        if constexpr (compiled) {
+            if ((started = isLevelEnabled(Level)))
+                beginProfilePoint(zone_fn(), key, value, rest...);
+        }
     }
 
     /// End the scoped profiler point.
     ///
     /// End the profiler point at the top of the local thread context.
     ~ScopedProfilePoint() {
-        if (started)
-            endProfilePoint();
+        if constexpr (compiled) {
+            if (started)
+                endProfilePoint();
+        }
     }
 };
 
@@ -119,20 +448,62 @@ struct ScopedProfilePoint {
 
 #define PROF_LVL_USER _profiler::PROF_LVL_USER
 #define PROF_LVL_ALL _profiler::PROF_LVL_ALL
-#define CHECK_PROF_LVL(PROF_LVL) (_profiler::getProfileLevel() >= PROF_LVL)
+#define CHECK_PROF_LVL(PROF_LVL) (_profiler::isCompiledLevel(PROF_LVL) && _profiler::isLevelEnabled(PROF_LVL))
 #define PROF_INIT_PROC(...) _profiler::initProcessProfiler(__VA_ARGS__)
 #define PROF_INIT_THD(...) _profiler::initThreadProfiler(__VA_ARGS__)
-#define PROF_BEGIN(PROF_LVL, ...)                                                                                                          \
-    if (CHECK_PROF_LVL(PROF_LVL))                                                                                                          \
-    _profiler::beginProfilePoint(__VA_ARGS__)
+// Function registering the call site on its first call and returning its
+// ZoneId. NAME must be a string literal.
+#define PROF_ZONE_FN(PROF_LVL, NAME)                                                                                                       \
+    []() -> _profiler::ZoneId {                                                                                                            \
+        static constexpr _profiler::ZoneDescriptor zone{NAME, __FILE__, __LINE__, PROF_LVL};                                               \
+        static const _profiler::ZoneId id = _profiler::registerZone(&zone);                                                                \
+        return id;                                                                                                                         \
+    }
+#define PROF_ZONE(PROF_LVL, NAME) (PROF_ZONE_FN(PROF_LVL, NAME)())
+#define PROF_BEGIN(PROF_LVL, NAME, ...)                                                                                                    \
+    if constexpr (_profiler::isCompiledLevel(PROF_LVL))                                                                                    \
+        if (_profiler::isLevelEnabled(PROF_LVL))                                                                                           \
+    _profiler::beginProfilePoint(PROF_ZONE(PROF_LVL, NAME) __VA_OPT__(, ) __VA_ARGS__)
 #define PROF_END(PROF_LVL)                                                                                                                 \
-    if (CHECK_PROF_LVL(PROF_LVL))                                                                                                          \
+    if constexpr (_profiler::isCompiledLevel(PROF_LVL))                                                                                    \
+        if (_profiler::isLevelEnabled(PROF_LVL))                                                                                           \
     _profiler::endProfilePoint()
-#define PROF_BEGIN_NEXT(...)                                                                                                               \
+#define PROF_BEGIN_NEXT(NAME, ...)                                                                                                         \
     _profiler::endProfilePoint();                                                                                                          \
-    _profiler::beginProfilePoint(__VA_ARGS__)
+    _profiler::beginProfilePoint(PROF_ZONE(PROF_LVL_USER, NAME) __VA_OPT__(, ) __VA_ARGS__)
+#define PROF_COUNTER(NAME, VALUE)                                                                                                          \
+    if constexpr (_profiler::isCompiledLevel(PROF_LVL_USER))                                                                               \
+        if (_profiler::isLevelEnabled(PROF_LVL_USER))                                                                                      \
+    _profiler::recordCounter(PROF_ZONE(PROF_LVL_USER, NAME), static_cast<double>(VALUE))
+#define PROF_INSTANT(NAME, ...)                                                                                                            \
+    if constexpr (_profiler::isCompiledLevel(PROF_LVL_USER))                                                                               \
+        if (_profiler::isLevelEnabled(PROF_LVL_USER))                                                                                      \
+    _profiler::recordInstant(PROF_ZONE(PROF_LVL_USER, NAME) __VA_OPT__(, ) __VA_ARGS__)
+#define PROF_FRAME_MARK()                                                                                                                  \
+    if constexpr (_profiler::isCompiledLevel(PROF_LVL_USER))                                                                               \
+        if (_profiler::isLevelEnabled(PROF_LVL_USER))                                                                                      \
+    _profiler::markFrame()
+#define PROF_NEW_FLOW_ID() _profiler::newFlowId()
+#define PROF_FLOW(PHASE, NAME, ID)                                                                                                         \
+    if constexpr (_profiler::isCompiledLevel(PROF_LVL_USER))                                                                               \
+        if (_profiler::isLevelEnabled(PROF_LVL_USER))                                                                                      \
+    _profiler::recordFlow(PROF_ZONE(PROF_LVL_USER, NAME), _profiler::FlowPhase::PHASE, ID)
+#define PROF_FLOW_START(NAME, ID) PROF_FLOW(start, NAME, ID)
+#define PROF_FLOW_STEP(NAME, ID) PROF_FLOW(step, NAME, ID)
+#define PROF_FLOW_END(NAME, ID) PROF_FLOW(end, NAME, ID)
+#define PROF_ASYNC_BEGIN(NAME, CATEGORY)                                                                                                   \
+    (CHECK_PROF_LVL(PROF_LVL_USER) ? _profiler::beginAsyncSpan(PROF_ZONE(PROF_LVL_USER, NAME), PROF_ZONE(PROF_LVL_USER, CATEGORY))         \
+                                   : _profiler::AsyncSpan{})
+#define PROF_ASYNC_END(SPAN) _profiler::endAsyncSpan(SPAN)
+#define PROF_ALLOC(BYTES) _profiler::recordAllocation(BYTES)
+#define PROF_FREE(BYTES) _profiler::recordDeallocation(BYTES)
 #define PROF_DUMP_TRACE() _profiler::dumpTracingFile()
-#define PROF_SCOPED(PROF_LVL, ...) _profiler::ScopedProfilePoint GEN_UNQ_SYM()(PROF_LVL, __VA_ARGS__)
+#define PROF_DUMP_SNAPSHOT() _profiler::dumpTracingSnapshot()
+// Profile point ending with the scope. Extra arguments are either details in
+// a stringified JSON format or typed key, value pairs, for instance:
+// PROF_SCOPED(PROF_LVL_USER, "load", "file", path, "bytes", size).
+#define PROF_SCOPED(PROF_LVL, NAME, ...)                                                                                                   \
+    _profiler::ScopedProfilePoint<PROF_LVL> GEN_UNQ_SYM()(PROF_ZONE_FN(PROF_LVL, NAME) __VA_OPT__(, ) __VA_ARGS__)
 #else
 
 #define PROF_INIT_PROC(...)                                                                                                                \
@@ -145,8 +516,30 @@ struct ScopedProfilePoint {
     {}
 #define PROF_BEGIN_NEXT(...)                                                                                                               \
     {}
+#define PROF_COUNTER(NAME, VALUE)                                                                                                          \
+    {}
+#define PROF_INSTANT(NAME, ...)                                                                                                            \
+    {}
+#define PROF_FRAME_MARK()                                                                                                                  \
+    {}
+#define PROF_NEW_FLOW_ID() 0
+#define PROF_FLOW_START(NAME, ID)                                                                                                          \
+    {}
+#define PROF_FLOW_STEP(NAME, ID)                                                                                                           \
+    {}
+#define PROF_FLOW_END(NAME, ID)                                                                                                            \
+    {}
+#define PROF_ASYNC_BEGIN(NAME, CATEGORY) 0
+#define PROF_ASYNC_END(SPAN)                                                                                                               \
+    {}
+#define PROF_ALLOC(BYTES)                                                                                                                  \
+    {}
+#define PROF_FREE(BYTES)                                                                                                                   \
+    {}
 #define PROF_DUMP_TRACE(filename)                                                                                                          \
     {}
+#define PROF_DUMP_SNAPSHOT()                                                                                                               \
+    {}
 #define PROF_SCOPED(PROF_LVL, ...)                                                                                                         \
     {}
 #define PROF_LVL_USER
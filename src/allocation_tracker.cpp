@@ -0,0 +1,137 @@
+//===------ allocation_tracker.cpp - Heap allocation tracking hooks -------===//
+//
+// Replacements of the global operator new and delete that report every heap
+// allocation and free to the profiler, which attributes them to the innermost
+// active zone of the calling thread when GP_ALLOC_TRACKING is set. They are
+// only compiled into builds defining PROF_TRACK_ALLOCATIONS.
+//
+//===----------------------------------------------------------------------===//
+#if defined(TRACY_ENABLE) && defined(PROF_TRACK_ALLOCATIONS)
+
+#include "profiler.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+#if defined(__APPLE__)
+#include <malloc/malloc.h>
+#else
+#include <malloc.h>
+#endif
+
+namespace _profiler {
+
+// Bytes actually reserved for `ptr`, so that frees count as many bytes as the
+// allocations they release, even when the size is not given back.
+static std::size_t usableSize(void *ptr, std::size_t alignment) {
+#if defined(_WIN32)
+    return alignment != 0 ? _aligned_msize(ptr, alignment, 0) : _msize(ptr);
+#elif defined(__APPLE__)
+    return malloc_size(ptr);
+#else
+    return malloc_usable_size(ptr);
+#endif
+}
+
+static void *tryAllocate(std::size_t size, std::size_t alignment) {
+    if (alignment == 0) {
+        return std::malloc(size);
+    }
+#ifdef _WIN32
+    return _aligned_malloc(size, alignment);
+#else
+    return std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+#endif
+}
+
+// Allocates like the default operator new: the new handler is called until
+// it frees enough memory, or throws.
+static void *allocate(std::size_t size, std::size_t alignment = 0) {
+    size = std::max<std::size_t>(size, 1);
+    while (true) {
+        if (void *ptr = tryAllocate(size, alignment)) {
+            recordAllocation(usableSize(ptr, alignment));
+            return ptr;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+static void *allocateNoThrow(std::size_t size, std::size_t alignment = 0) noexcept {
+    try {
+        return allocate(size, alignment);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+static void deallocate(void *ptr, std::size_t alignment = 0) noexcept {
+    if (ptr == nullptr) {
+        return;
+    }
+    recordDeallocation(usableSize(ptr, alignment));
+#ifdef _WIN32
+    if (alignment != 0) {
+        _aligned_free(ptr);
+        return;
+    }
+#endif
+    std::free(ptr);
+}
+
+} // namespace _profiler
+
+// ============================================================================
+// ======================= Replaceable global operators =======================
+// ============================================================================
+
+void *operator new(std::size_t size) { return _profiler::allocate(size); }
+void *operator new[](std::size_t size) { return _profiler::allocate(size); }
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept { return _profiler::allocateNoThrow(size); }
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept { return _profiler::allocateNoThrow(size); }
+
+void *operator new(std::size_t size, std::align_val_t alignment) {
+    return _profiler::allocate(size, static_cast<std::size_t>(alignment));
+}
+void *operator new[](std::size_t size, std::align_val_t alignment) {
+    return _profiler::allocate(size, static_cast<std::size_t>(alignment));
+}
+void *operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return _profiler::allocateNoThrow(size, static_cast<std::size_t>(alignment));
+}
+void *operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return _profiler::allocateNoThrow(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void *ptr) noexcept { _profiler::deallocate(ptr); }
+void operator delete[](void *ptr) noexcept { _profiler::deallocate(ptr); }
+void operator delete(void *ptr, std::size_t) noexcept { _profiler::deallocate(ptr); }
+void operator delete[](void *ptr, std::size_t) noexcept { _profiler::deallocate(ptr); }
+void operator delete(void *ptr, const std::nothrow_t &) noexcept { _profiler::deallocate(ptr); }
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept { _profiler::deallocate(ptr); }
+
+void operator delete(void *ptr, std::align_val_t alignment) noexcept {
+    _profiler::deallocate(ptr, static_cast<std::size_t>(alignment));
+}
+void operator delete[](void *ptr, std::align_val_t alignment) noexcept {
+    _profiler::deallocate(ptr, static_cast<std::size_t>(alignment));
+}
+void operator delete(void *ptr, std::size_t, std::align_val_t alignment) noexcept {
+    _profiler::deallocate(ptr, static_cast<std::size_t>(alignment));
+}
+void operator delete[](void *ptr, std::size_t, std::align_val_t alignment) noexcept {
+    _profiler::deallocate(ptr, static_cast<std::size_t>(alignment));
+}
+void operator delete(void *ptr, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    _profiler::deallocate(ptr, static_cast<std::size_t>(alignment));
+}
+void operator delete[](void *ptr, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    _profiler::deallocate(ptr, static_cast<std::size_t>(alignment));
+}
+
+#endif // TRACY_ENABLE && PROF_TRACK_ALLOCATIONS
@@ -0,0 +1,514 @@
+//===------ binary_trace.cpp - Compact binary profiler trace format ------===//
+//
+// Definitions of the writer and reader of the compact binary trace format.
+//
+//===----------------------------------------------------------------------===//
+#ifdef TRACY_ENABLE
+
+#include "binary_trace.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <deque>
+#include <memory>
+
+namespace _profiler {
+
+static constexpr char binary_trace_magic[] = {'R', 'P', 'T', 'R', 'A', 'C', 'E'};
+static constexpr uint8_t binary_trace_version = 2;
+
+static constexpr size_t max_varint_size = 10;
+
+static uint64_t zigzagEncode(int64_t value) { return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63); }
+
+static int64_t zigzagDecode(uint64_t value) { return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1); }
+
+static size_t encodeVarint(uint64_t value, char *out) {
+    size_t size = 0;
+    while (value >= 0x80) {
+        out[size++] = static_cast<char>(value | 0x80);
+        value >>= 7;
+    }
+    out[size++] = static_cast<char>(value);
+    return size;
+}
+
+// ============================================================================
+// ============================== Writer ======================================
+// ============================================================================
+
+BinaryTraceWriter::BinaryTraceWriter(const std::string &filename) : output(filename) {
+    output.put(std::string_view(binary_trace_magic, sizeof(binary_trace_magic)));
+    output.put(static_cast<char>(binary_trace_version));
+}
+
+BinaryTraceWriter::BinaryTraceWriter(Fragment) { output.put('R'); }
+
+BinaryTraceWriter::~BinaryTraceWriter() { endBlock(); }
+
+void BinaryTraceWriter::completeEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t start_ns, int64_t duration_ns,
+                                      std::string_view args) {
+    uint64_t name_id = internString(name);
+    beginBlock(pid, tid);
+    block.push_back('X');
+    putBlockVarint(name_id);
+    putBlockVarint(zigzagEncode(start_ns - block_time));
+    putBlockVarint(zigzagEncode(duration_ns));
+    putBlockArgs(args);
+    block_time = start_ns;
+}
+
+void BinaryTraceWriter::unfinishedEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t start_ns, std::string_view args) {
+    uint64_t name_id = internString(name);
+    beginBlock(pid, tid);
+    block.push_back('B');
+    putBlockVarint(name_id);
+    putBlockVarint(zigzagEncode(start_ns - block_time));
+    putBlockArgs(args);
+    block_time = start_ns;
+}
+
+void BinaryTraceWriter::counterEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t time_ns, double value) {
+    uint64_t name_id = internString(name);
+    beginBlock(pid, tid);
+    block.push_back('C');
+    putBlockVarint(name_id);
+    putBlockVarint(zigzagEncode(time_ns - block_time));
+    putBlockDouble(value);
+    block_time = time_ns;
+}
+
+void BinaryTraceWriter::instantEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t time_ns, char scope) {
+    uint64_t name_id = internString(name);
+    beginBlock(pid, tid);
+    block.push_back('I');
+    putBlockVarint(name_id);
+    putBlockVarint(zigzagEncode(time_ns - block_time));
+    block.push_back(scope);
+    block_time = time_ns;
+}
+
+void BinaryTraceWriter::flowEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t time_ns, char phase, uint64_t id) {
+    uint64_t name_id = internString(name);
+    beginBlock(pid, tid);
+    block.push_back('F');
+    putBlockVarint(name_id);
+    putBlockVarint(zigzagEncode(time_ns - block_time));
+    block.push_back(phase);
+    putBlockVarint(id);
+    block_time = time_ns;
+}
+
+void BinaryTraceWriter::asyncEvent(std::string_view name, std::string_view category, uint32_t pid, int64_t tid, int64_t time_ns,
+                                   char phase, uint64_t id) {
+    uint64_t name_id = internString(name);
+    uint64_t category_id = internString(category);
+    beginBlock(pid, tid);
+    block.push_back('A');
+    putBlockVarint(name_id);
+    putBlockVarint(zigzagEncode(time_ns - block_time));
+    block.push_back(phase);
+    putBlockVarint(category_id);
+    putBlockVarint(id);
+    block_time = time_ns;
+}
+
+void BinaryTraceWriter::sampleEvent(uint32_t pid, int64_t tid, int64_t time_ns, const std::vector<std::string_view> &frames) {
+    std::vector<uint64_t> frame_ids;
+    for (std::string_view frame : frames) {
+        frame_ids.push_back(internString(frame));
+    }
+    beginBlock(pid, tid);
+    block.push_back('Q');
+    putBlockVarint(zigzagEncode(time_ns - block_time));
+    putBlockVarint(frame_ids.size());
+    for (uint64_t frame_id : frame_ids) {
+        putBlockVarint(frame_id);
+    }
+    block_time = time_ns;
+}
+
+void BinaryTraceWriter::processMetadata(uint32_t pid, std::string_view name, int sort_index) {
+    uint64_t name_id = internString(name);
+    output.put('P');
+    putVarint(pid);
+    putVarint(zigzagEncode(sort_index));
+    putVarint(name_id);
+}
+
+void BinaryTraceWriter::threadMetadata(uint32_t pid, int64_t tid, std::string_view name, int sort_index) {
+    uint64_t name_id = internString(name);
+    output.put('T');
+    putVarint(pid);
+    putVarint(zigzagEncode(tid));
+    putVarint(zigzagEncode(sort_index));
+    putVarint(name_id);
+}
+
+void BinaryTraceWriter::flush() {
+    endBlock();
+    output.flush();
+}
+
+std::unique_ptr<TraceWriter> BinaryTraceWriter::fragment() {
+    return std::unique_ptr<BinaryTraceWriter>(new BinaryTraceWriter(Fragment{}));
+}
+
+// The fragment resets the string numbering, so the strings of this writer are
+// written again when they are next used.
+void BinaryTraceWriter::append(TraceWriter &fragment) {
+    auto &records = static_cast<BinaryTraceWriter &>(fragment);
+    records.endBlock();
+    std::string data = records.output.take();
+    if (data.size() <= 1) {
+        return;
+    }
+
+    endBlock();
+    output.put(data);
+    strings.clear();
+}
+
+// Strings are written once, the first time they are used, and referred to by
+// their order of appearance afterwards.
+uint64_t BinaryTraceWriter::internString(std::string_view str) {
+    if (auto it = strings.find(str); it != strings.end()) {
+        return it->second;
+    }
+
+    uint64_t id = strings.size();
+    strings.emplace(str, id);
+    output.put('S');
+    putVarint(str.size());
+    output.put(str);
+    return id;
+}
+
+void BinaryTraceWriter::beginBlock(uint32_t pid, int64_t tid) {
+    if (!block.empty() && pid == block_pid && tid == block_tid) {
+        return;
+    }
+
+    endBlock();
+    block_pid = pid;
+    block_tid = tid;
+    block_time = 0;
+}
+
+void BinaryTraceWriter::endBlock() {
+    if (block.empty()) {
+        return;
+    }
+
+    output.put('K');
+    putVarint(block_pid);
+    putVarint(zigzagEncode(block_tid));
+    putVarint(block.size());
+    output.put(std::string_view(block.data(), block.size()));
+    block.clear();
+}
+
+void BinaryTraceWriter::putVarint(uint64_t value) {
+    char bytes[max_varint_size];
+    output.put(std::string_view(bytes, encodeVarint(value, bytes)));
+}
+
+void BinaryTraceWriter::putBlockVarint(uint64_t value) {
+    char bytes[max_varint_size];
+    block.insert(block.end(), bytes, bytes + encodeVarint(value, bytes));
+}
+
+// Args are mostly distinct, so they are written along their event rather than
+// interned, the empty object being written as an empty string.
+void BinaryTraceWriter::putBlockArgs(std::string_view args) {
+    if (args == "{}") {
+        args = {};
+    }
+    putBlockVarint(args.size());
+    block.insert(block.end(), args.begin(), args.end());
+}
+
+void BinaryTraceWriter::putBlockDouble(double value) {
+    uint64_t bits = std::bit_cast<uint64_t>(value);
+    for (int byte = 0; byte < 8; byte++) {
+        block.push_back(static_cast<char>(bits >> (8 * byte)));
+    }
+}
+
+// ============================================================================
+// ============================== Reader ======================================
+// ============================================================================
+
+namespace {
+
+// Buffered sequential reader of a file or of an in-memory block.
+class ByteReader {
+public:
+    explicit ByteReader(TraceInput *file) : file(file), buffer(new char[buffer_size]) {}
+    ByteReader(const char *data, size_t size) : begin(data), end(data + size) {}
+
+    bool get(char &c) {
+        if (begin == end && !refill()) {
+            return false;
+        }
+        c = *begin++;
+        return true;
+    }
+
+    bool read(char *out, size_t size) {
+        while (size > 0) {
+            if (begin == end && !refill()) {
+                return false;
+            }
+            size_t n = std::min<size_t>(size, end - begin);
+            std::memcpy(out, begin, n);
+            begin += n;
+            out += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    bool varint(uint64_t &value) {
+        value = 0;
+        for (unsigned shift = 0; shift < 64; shift += 7) {
+            char c;
+            if (!get(c)) {
+                return false;
+            }
+            value |= static_cast<uint64_t>(c & 0x7f) << shift;
+            if ((c & 0x80) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool number(double &value) {
+        unsigned char bytes[8];
+        if (!read(reinterpret_cast<char *>(bytes), sizeof(bytes))) {
+            return false;
+        }
+        uint64_t bits = 0;
+        for (int byte = 0; byte < 8; byte++) {
+            bits |= uint64_t(bytes[byte]) << (8 * byte);
+        }
+        value = std::bit_cast<double>(bits);
+        return true;
+    }
+
+    bool signedVarint(int64_t &value) {
+        uint64_t encoded;
+        if (!varint(encoded)) {
+            return false;
+        }
+        value = zigzagDecode(encoded);
+        return true;
+    }
+
+    bool atEnd() { return begin == end && !refill(); }
+
+    // Only for in-memory blocks, whose bytes outlive the reader.
+    bool view(size_t size, std::string_view &out) {
+        if (static_cast<size_t>(end - begin) < size) {
+            return false;
+        }
+        out = std::string_view(begin, size);
+        begin += size;
+        return true;
+    }
+
+private:
+    static constexpr size_t buffer_size = 1 << 20;
+
+    bool refill() {
+        if (file == nullptr) {
+            return false;
+        }
+        size_t n = file->read(buffer.get(), buffer_size);
+        begin = buffer.get();
+        end = begin + n;
+        return n > 0;
+    }
+
+    TraceInput *file = nullptr;
+    std::unique_ptr<char[]> buffer;
+    const char *begin = nullptr;
+    const char *end = nullptr;
+};
+
+// Replays the records of a binary trace into a writer.
+class BinaryTraceReader {
+public:
+    BinaryTraceReader(TraceInput &file, TraceWriter &writer) : input(&file), writer(writer) {}
+
+    bool run() {
+        char magic[sizeof(binary_trace_magic)];
+        char version;
+        if (!input.read(magic, sizeof(magic)) || std::memcmp(magic, binary_trace_magic, sizeof(magic)) != 0 ||
+            !input.get(version) || static_cast<uint8_t>(version) != binary_trace_version) {
+            return false;
+        }
+
+        while (!input.atEnd()) {
+            if (!readRecord()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    bool readRecord() {
+        char tag;
+        if (!input.get(tag)) {
+            return false;
+        }
+
+        uint64_t pid, size;
+        int64_t tid, sort_index;
+        std::string_view name;
+        switch (tag) {
+        case 'R':
+            strings.clear();
+            return true;
+        case 'S':
+            if (!input.varint(size)) {
+                return false;
+            }
+            strings.emplace_back(size, '\0');
+            return input.read(strings.back().data(), size);
+        case 'P':
+            if (!input.varint(pid) || !input.signedVarint(sort_index) || !readString(input, name)) {
+                return false;
+            }
+            writer.processMetadata(pid, name, sort_index);
+            return true;
+        case 'T':
+            if (!input.varint(pid) || !input.signedVarint(tid) || !input.signedVarint(sort_index) || !readString(input, name)) {
+                return false;
+            }
+            writer.threadMetadata(pid, tid, name, sort_index);
+            return true;
+        case 'K':
+            if (!input.varint(pid) || !input.signedVarint(tid) || !input.varint(size)) {
+                return false;
+            }
+            block.resize(size);
+            return input.read(block.data(), size) && readBlock(pid, tid);
+        default:
+            return false;
+        }
+    }
+
+    bool readBlock(uint32_t pid, int64_t tid) {
+        ByteReader events(block.data(), block.size());
+        int64_t time = 0;
+        while (!events.atEnd()) {
+            char tag = 0;
+            std::string_view name, args;
+            int64_t delta, duration;
+            events.get(tag);
+            if (tag == 'X') {
+                if (!readString(events, name) || !events.signedVarint(delta) || !events.signedVarint(duration) ||
+                    !readArgs(events, args)) {
+                    return false;
+                }
+                time += delta;
+                writer.completeEvent(name, pid, tid, time, duration, args);
+            } else if (tag == 'B') {
+                if (!readString(events, name) || !events.signedVarint(delta) || !readArgs(events, args)) {
+                    return false;
+                }
+                time += delta;
+                writer.unfinishedEvent(name, pid, tid, time, args);
+            } else if (tag == 'C') {
+                double value;
+                if (!readString(events, name) || !events.signedVarint(delta) || !events.number(value)) {
+                    return false;
+                }
+                time += delta;
+                writer.counterEvent(name, pid, tid, time, value);
+            } else if (tag == 'I') {
+                char scope = 0;
+                if (!readString(events, name) || !events.signedVarint(delta) || !events.get(scope)) {
+                    return false;
+                }
+                time += delta;
+                writer.instantEvent(name, pid, tid, time, scope);
+            } else if (tag == 'F') {
+                char phase = 0;
+                uint64_t id;
+                if (!readString(events, name) || !events.signedVarint(delta) || !events.get(phase) || !events.varint(id)) {
+                    return false;
+                }
+                time += delta;
+                writer.flowEvent(name, pid, tid, time, phase, id);
+            } else if (tag == 'A') {
+                char phase = 0;
+                std::string_view category;
+                uint64_t id;
+                if (!readString(events, name) || !events.signedVarint(delta) || !events.get(phase) || !readString(events, category) ||
+                    !events.varint(id)) {
+                    return false;
+                }
+                time += delta;
+                writer.asyncEvent(name, category, pid, tid, time, phase, id);
+            } else if (tag == 'Q') {
+                uint64_t depth;
+                if (!events.signedVarint(delta) || !events.varint(depth) || depth > block.size()) {
+                    return false;
+                }
+                frames.resize(depth);
+                for (std::string_view &frame : frames) {
+                    if (!readString(events, frame)) {
+                        return false;
+                    }
+                }
+                time += delta;
+                writer.sampleEvent(pid, tid, time, frames);
+            } else {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool readString(ByteReader &reader, std::string_view &str) {
+        uint64_t id;
+        if (!reader.varint(id) || id >= strings.size()) {
+            return false;
+        }
+        str = strings[id];
+        return true;
+    }
+
+    bool readArgs(ByteReader &reader, std::string_view &args) {
+        uint64_t size;
+        if (!reader.varint(size) || !reader.view(size, args)) {
+            return false;
+        }
+        if (args.empty()) {
+            args = "{}";
+        }
+        return true;
+    }
+
+    ByteReader input;
+    TraceWriter &writer;
+    std::deque<std::string> strings;
+    std::vector<char> block;
+    std::vector<std::string_view> frames; // Frames of the last stack sample
+};
+
+} // namespace
+
+bool convertBinaryTrace(const std::string &filename, TraceWriter &writer) {
+    TraceInput file(filename);
+    return file.isOpen() && BinaryTraceReader(file, writer).run();
+}
+
+} // namespace _profiler
+
+#endif // TRACY_ENABLE
@@ -0,0 +1,123 @@
+//===------ binary_trace.hpp - Compact binary profiler trace format ------===//
+//
+// Declarations of the writer and reader of the compact binary trace format,
+// converted offline into the Chrome Trace Event format.
+//
+// The file starts with the magic "RPTRACE" and a version byte, followed by
+// records made of a tag byte and LEB128 varints (signed values are zigzag
+// encoded):
+//
+// - 'S' length bytes: string, numbered in order of appearance.
+// - 'R': reset of the string numbering, starting each appended fragment.
+// - 'P' pid sort_index name: process metadata.
+// - 'T' pid tid sort_index name: thread metadata.
+// - 'K' pid tid size events: block of events of a thread, where each event is
+//   'X' name start_delta duration args, 'B' name start_delta args, 'C' name
+//   start_delta value, the value being a little-endian IEEE double, 'I' name
+//   start_delta scope, 'F' name start_delta phase id or 'A' name start_delta
+//   phase category id, the scope and phases being a byte, or 'Q' start_delta
+//   depth frames, a stack sample listing the names of its frames from the
+//   outermost one. Start timestamps are deltas from the previous event of the
+//   block, and args are a length followed by their bytes, empty for "{}".
+//
+// Names, categories and frames refer to strings written before the record
+// using them.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef _BINARY_TRACE_H
+#define _BINARY_TRACE_H
+
+#ifdef TRACY_ENABLE
+
+#include "trace_writer.hpp"
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace _profiler {
+
+/// Extension of the binary trace files.
+inline constexpr std::string_view binary_trace_extension = ".rptrace";
+
+/// Streaming writer of the compact binary trace format.
+///
+/// Events are encoded into a block until another thread writes an event or
+/// the writer is flushed, so consecutive events of a thread share a block.
+class BinaryTraceWriter : public TraceWriter {
+public:
+    /// Open \p filename and write the file header.
+    explicit BinaryTraceWriter(const std::string &filename);
+
+    /// Write the pending block and close the file.
+    ~BinaryTraceWriter() override;
+
+    bool isOpen() const override { return output.isOpen(); }
+
+    void completeEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t start_ns, int64_t duration_ns,
+                       std::string_view args) override;
+
+    void unfinishedEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t start_ns, std::string_view args) override;
+
+    void counterEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t time_ns, double value) override;
+
+    void instantEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t time_ns, char scope) override;
+
+    void flowEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t time_ns, char phase, uint64_t id) override;
+
+    void asyncEvent(std::string_view name, std::string_view category, uint32_t pid, int64_t tid, int64_t time_ns, char phase,
+                    uint64_t id) override;
+
+    void sampleEvent(uint32_t pid, int64_t tid, int64_t time_ns, const std::vector<std::string_view> &frames) override;
+
+    void processMetadata(uint32_t pid, std::string_view name, int sort_index) override;
+
+    void threadMetadata(uint32_t pid, int64_t tid, std::string_view name, int sort_index) override;
+
+    void flush() override;
+
+    std::unique_ptr<TraceWriter> fragment() override;
+
+    void append(TraceWriter &fragment) override;
+
+private:
+    struct Fragment {};
+
+    /// Fragment of the trace, with its own string numbering.
+    explicit BinaryTraceWriter(Fragment);
+
+    struct StringHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view str) const { return std::hash<std::string_view>{}(str); }
+    };
+
+    uint64_t internString(std::string_view str);
+    void beginBlock(uint32_t pid, int64_t tid);
+    void endBlock();
+    void putVarint(uint64_t value);
+    void putBlockVarint(uint64_t value);
+    void putBlockArgs(std::string_view args);
+    void putBlockDouble(double value);
+
+    TraceOutput output;
+    std::unordered_map<std::string, uint64_t, StringHash, std::equal_to<>> strings;
+    std::vector<char> block; // Encoded events of the pending block
+    uint32_t block_pid = 0;
+    int64_t block_tid = 0;
+    int64_t block_time = 0; // Start of the previous event of the block
+};
+
+/// Convert the binary trace file \p filename, compressed or not, by replaying
+/// its records into \p writer.
+///
+/// \returns false if the file could not be opened or is malformed. The
+/// records read before a truncated end are still replayed.
+bool convertBinaryTrace(const std::string &filename, TraceWriter &writer);
+
+} // namespace _profiler
+
+#endif // TRACY_ENABLE
+
+#endif // _BINARY_TRACE_H
@@ -0,0 +1,275 @@
+//===--- chrome_trace_writer.cpp - Streaming Chrome Trace Event writer ----===//
+//
+// Definitions of a writer that streams events in the Chrome Trace Event JSON
+// format straight into a buffered file, without building a JSON document.
+//
+//===----------------------------------------------------------------------===//
+#ifdef TRACY_ENABLE
+
+#include "chrome_trace_writer.hpp"
+
+#include <charconv>
+#include <cmath>
+
+namespace _profiler {
+
+ChromeTraceWriter::ChromeTraceWriter(const std::string &filename) : output(filename) { put('['); }
+
+ChromeTraceWriter::ChromeTraceWriter(Fragment) : is_fragment(true) {}
+
+ChromeTraceWriter::~ChromeTraceWriter() {
+    if (!is_fragment) {
+        put("\n]\n");
+    }
+}
+
+void ChromeTraceWriter::completeEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t start_ns, int64_t duration_ns,
+                                      std::string_view args) {
+    beginEvent();
+    put("{\"ph\":\"X\",\"name\":");
+    putString(name);
+    put(",\"pid\":");
+    putInteger(pid);
+    put(",\"tid\":");
+    putInteger(tid);
+    put(",\"ts\":");
+    putMicroseconds(start_ns);
+    put(",\"dur\":");
+    putMicroseconds(duration_ns);
+    put(",\"args\":");
+    put(args);
+    put('}');
+}
+
+void ChromeTraceWriter::unfinishedEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t start_ns, std::string_view args) {
+    beginEvent();
+    put("{\"ph\":\"B\",\"name\":");
+    putString(name);
+    put(",\"pid\":");
+    putInteger(pid);
+    put(",\"tid\":");
+    putInteger(tid);
+    put(",\"ts\":");
+    putMicroseconds(start_ns);
+    put(",\"args\":");
+    put(args);
+    put('}');
+}
+
+void ChromeTraceWriter::counterEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t time_ns, double value) {
+    beginEvent();
+    put("{\"ph\":\"C\",\"name\":");
+    putString(name);
+    put(",\"pid\":");
+    putInteger(pid);
+    put(",\"tid\":");
+    putInteger(tid);
+    put(",\"ts\":");
+    putMicroseconds(time_ns);
+    put(",\"args\":{\"value\":");
+    putNumber(value);
+    put("}}");
+}
+
+void ChromeTraceWriter::instantEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t time_ns, char scope) {
+    beginEvent();
+    put("{\"ph\":\"i\",\"name\":");
+    putString(name);
+    put(",\"pid\":");
+    putInteger(pid);
+    put(",\"tid\":");
+    putInteger(tid);
+    put(",\"ts\":");
+    putMicroseconds(time_ns);
+    put(",\"s\":\"");
+    put(scope);
+    put("\"}");
+}
+
+// Flow ends bind to the next slice by default, "bp":"e" binds every step to
+// the slice enclosing it.
+void ChromeTraceWriter::flowEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t time_ns, char phase, uint64_t id) {
+    beginEvent();
+    put("{\"ph\":\"");
+    put(phase);
+    put("\",\"name\":");
+    putString(name);
+    put(",\"cat\":\"flow\",\"id\":");
+    putInteger(static_cast<int64_t>(id));
+    put(",\"pid\":");
+    putInteger(pid);
+    put(",\"tid\":");
+    putInteger(tid);
+    put(",\"ts\":");
+    putMicroseconds(time_ns);
+    put(",\"bp\":\"e\"}");
+}
+
+void ChromeTraceWriter::asyncEvent(std::string_view name, std::string_view category, uint32_t pid, int64_t tid, int64_t time_ns,
+                                   char phase, uint64_t id) {
+    beginEvent();
+    put("{\"ph\":\"");
+    put(phase);
+    put("\",\"name\":");
+    putString(name);
+    put(",\"cat\":");
+    putString(category);
+    put(",\"id\":");
+    putInteger(static_cast<int64_t>(id));
+    put(",\"pid\":");
+    putInteger(pid);
+    put(",\"tid\":");
+    putInteger(tid);
+    put(",\"ts\":");
+    putMicroseconds(time_ns);
+    put('}');
+}
+
+void ChromeTraceWriter::sampleEvent(uint32_t pid, int64_t tid, int64_t time_ns, const std::vector<std::string_view> &frames) {
+    beginEvent();
+    put("{\"ph\":\"i\",\"name\":");
+    putString(frames.empty() ? std::string_view("(unknown)") : frames.back());
+    put(",\"cat\":\"sample\",\"pid\":");
+    putInteger(pid);
+    put(",\"tid\":");
+    putInteger(tid);
+    put(",\"ts\":");
+    putMicroseconds(time_ns);
+    put(",\"s\":\"t\",\"args\":{\"stack\":[");
+    for (size_t frame = 0; frame < frames.size(); frame++) {
+        if (frame > 0) {
+            put(',');
+        }
+        putString(frames[frame]);
+    }
+    put("]}}");
+}
+
+void ChromeTraceWriter::processMetadata(uint32_t pid, std::string_view name, int sort_index) {
+    beginEvent();
+    put("{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":");
+    putInteger(pid);
+    put(",\"args\":{\"name\":");
+    putString(name);
+    put("}}");
+
+    beginEvent();
+    put("{\"ph\":\"M\",\"name\":\"process_sort_index\",\"pid\":");
+    putInteger(pid);
+    put(",\"args\":{\"sort_index\":");
+    putInteger(sort_index);
+    put("}}");
+}
+
+void ChromeTraceWriter::threadMetadata(uint32_t pid, int64_t tid, std::string_view name, int sort_index) {
+    beginEvent();
+    put("{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":");
+    putInteger(pid);
+    put(",\"tid\":");
+    putInteger(tid);
+    put(",\"args\":{\"name\":");
+    putString(name);
+    put("}}");
+
+    beginEvent();
+    put("{\"ph\":\"M\",\"name\":\"thread_sort_index\",\"pid\":");
+    putInteger(pid);
+    put(",\"tid\":");
+    putInteger(tid);
+    put(",\"args\":{\"sort_index\":");
+    putInteger(sort_index);
+    put("}}");
+}
+
+std::unique_ptr<TraceWriter> ChromeTraceWriter::fragment() {
+    return std::unique_ptr<ChromeTraceWriter>(new ChromeTraceWriter(Fragment{}));
+}
+
+// A fragment starts like a document without its bracket, so only the
+// separator with the events before it is missing.
+void ChromeTraceWriter::append(TraceWriter &fragment) {
+    auto &events = static_cast<ChromeTraceWriter &>(fragment);
+    if (events.first_event) {
+        return;
+    }
+    if (!first_event) {
+        put(',');
+    }
+    put(events.output.take());
+    first_event = false;
+}
+
+void ChromeTraceWriter::beginEvent() {
+    // One event per line keeps the output greppable.
+    put(first_event ? "\n" : ",\n");
+    first_event = false;
+}
+
+void ChromeTraceWriter::putString(std::string_view str) {
+    static constexpr char hex_digits[] = "0123456789abcdef";
+
+    put('"');
+    for (char c : str) {
+        switch (c) {
+        case '"':
+            put("\\\"");
+            break;
+        case '\\':
+            put("\\\\");
+            break;
+        case '\n':
+            put("\\n");
+            break;
+        case '\r':
+            put("\\r");
+            break;
+        case '\t':
+            put("\\t");
+            break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                put("\\u00");
+                put(hex_digits[c >> 4]);
+                put(hex_digits[c & 0xf]);
+            } else {
+                put(c);
+            }
+        }
+    }
+    put('"');
+}
+
+void ChromeTraceWriter::putInteger(int64_t value) {
+    char digits[24];
+    auto [end, ec] = std::to_chars(digits, digits + sizeof(digits), value);
+    put(std::string_view(digits, end - digits));
+}
+
+// JSON has no infinities nor NaN.
+void ChromeTraceWriter::putNumber(double value) {
+    if (!std::isfinite(value)) {
+        put("null");
+        return;
+    }
+    char digits[32];
+    auto [end, ec] = std::to_chars(digits, digits + sizeof(digits), value);
+    put(std::string_view(digits, end - digits));
+}
+
+void ChromeTraceWriter::putMicroseconds(int64_t ns) {
+    // Exact fixed point conversion: microseconds with three decimal places.
+    if (ns < 0) {
+        put('-');
+        ns = -ns;
+    }
+    putInteger(ns / 1000);
+    int64_t fraction = ns % 1000;
+    if (fraction != 0) {
+        char digits[4] = {'.', char('0' + fraction / 100), char('0' + fraction / 10 % 10), char('0' + fraction % 10)};
+        put(std::string_view(digits, sizeof(digits)));
+    }
+}
+
+} // namespace _profiler
+
+#endif // TRACY_ENABLE
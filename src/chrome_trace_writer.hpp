@@ -0,0 +1,94 @@
+//===--- chrome_trace_writer.hpp - Streaming Chrome Trace Event writer ----===//
+//
+// Declarations of a writer that streams events in the Chrome Trace Event JSON
+// format straight into a buffered file, without building a JSON document.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef _CHROME_TRACE_WRITER_H
+#define _CHROME_TRACE_WRITER_H
+
+#ifdef TRACY_ENABLE
+
+#include "trace_writer.hpp"
+
+namespace _profiler {
+
+/// Streaming writer of compact Chrome Trace Event JSON.
+///
+/// Events are formatted directly into the fixed-size buffer of a TraceOutput,
+/// so the memory overhead is constant no matter how many events are written.
+/// Timestamps are emitted in microseconds, as expected by the trace viewers.
+///
+/// The JSON Array Format is used: its closing bracket is optional, so a trace
+/// that was being flushed incrementally stays loadable if the process dies.
+class ChromeTraceWriter : public TraceWriter {
+public:
+    /// Open \p filename and start the trace document.
+    explicit ChromeTraceWriter(const std::string &filename);
+
+    /// Finish the trace document and close the file.
+    ~ChromeTraceWriter() override;
+
+    bool isOpen() const override { return output.isOpen(); }
+
+    /// Write a complete ("X") event, with \p args as its args object.
+    void completeEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t start_ns, int64_t duration_ns,
+                       std::string_view args) override;
+
+    /// Write a begin ("B") event without its end, shown as unfinished.
+    void unfinishedEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t start_ns, std::string_view args) override;
+
+    /// Write a counter ("C") event, its value being its only series.
+    void counterEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t time_ns, double value) override;
+
+    /// Write an instant ("i") event, its scope in "s".
+    void instantEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t time_ns, char scope) override;
+
+    /// Write a flow ("s", "t" or "f") event bound to its enclosing slice.
+    void flowEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t time_ns, char phase, uint64_t id) override;
+
+    /// Write a nestable async ("b" or "e") event.
+    void asyncEvent(std::string_view name, std::string_view category, uint32_t pid, int64_t tid, int64_t time_ns, char phase,
+                    uint64_t id) override;
+
+    /// Write a thread instant ("i") event named by the sampled function, with
+    /// the whole stack in its args.
+    void sampleEvent(uint32_t pid, int64_t tid, int64_t time_ns, const std::vector<std::string_view> &frames) override;
+
+    /// Write the metadata ("M") events naming and ordering a process.
+    void processMetadata(uint32_t pid, std::string_view name, int sort_index) override;
+
+    /// Write the metadata ("M") events naming and ordering a thread.
+    void threadMetadata(uint32_t pid, int64_t tid, std::string_view name, int sort_index) override;
+
+    void flush() override { output.flush(); }
+
+    std::unique_ptr<TraceWriter> fragment() override;
+
+    void append(TraceWriter &fragment) override;
+
+private:
+    struct Fragment {};
+
+    /// Fragment of the trace document, without its brackets.
+    explicit ChromeTraceWriter(Fragment);
+
+    void beginEvent();
+    void put(char c) { output.put(c); }
+    void put(std::string_view str) { output.put(str); }
+    void putString(std::string_view str);
+    void putInteger(int64_t value);
+    void putNumber(double value);
+    void putMicroseconds(int64_t ns);
+
+    TraceOutput output;
+    bool is_fragment = false;
+    bool first_event = true;
+};
+
+} // namespace _profiler
+
+#endif // TRACY_ENABLE
+
+#endif // _CHROME_TRACE_WRITER_H
@@ -0,0 +1,528 @@
+//===--- perfetto_trace_writer.cpp - Perfetto protobuf trace writer ------===//
+//
+// Definitions of a writer that streams events as Perfetto TracePacket
+// protobuf messages.
+//
+//===----------------------------------------------------------------------===//
+#ifdef TRACY_ENABLE
+
+#include "perfetto_trace_writer.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <limits>
+
+#include <json/json.hpp>
+
+namespace _profiler {
+
+// Field numbers of the Perfetto protos (protos/perfetto/trace/).
+namespace proto {
+constexpr uint32_t trace_packet = 1;
+
+constexpr uint32_t packet_timestamp = 8;
+constexpr uint32_t packet_sequence_id = 10;
+constexpr uint32_t packet_track_event = 11;
+constexpr uint32_t packet_interned_data = 12;
+constexpr uint32_t packet_sequence_flags = 13;
+constexpr uint32_t packet_track_descriptor = 60;
+
+constexpr uint64_t seq_incremental_state_cleared = 1;
+constexpr uint64_t seq_needs_incremental_state = 2;
+
+constexpr uint32_t track_uuid = 1;
+constexpr uint32_t track_name = 2;
+constexpr uint32_t track_process = 3;
+constexpr uint32_t track_thread = 4;
+constexpr uint32_t track_parent_uuid = 5;
+constexpr uint32_t track_counter = 8;
+
+constexpr uint32_t process_pid = 1;
+constexpr uint32_t process_name = 6;
+
+constexpr uint32_t thread_pid = 1;
+constexpr uint32_t thread_tid = 2;
+constexpr uint32_t thread_name = 5;
+
+constexpr uint32_t event_debug_annotations = 4;
+constexpr uint32_t event_type = 9;
+constexpr uint32_t event_name_iid = 10;
+constexpr uint32_t event_track_uuid = 11;
+constexpr uint32_t event_categories = 22;
+constexpr uint32_t event_name = 23;
+constexpr uint32_t event_double_counter_value = 44;
+constexpr uint32_t event_flow_ids = 47;
+constexpr uint32_t event_terminating_flow_ids = 48;
+
+constexpr uint64_t type_slice_begin = 1;
+constexpr uint64_t type_slice_end = 2;
+constexpr uint64_t type_instant = 3;
+constexpr uint64_t type_counter = 4;
+
+constexpr uint32_t annotation_bool_value = 2;
+constexpr uint32_t annotation_uint_value = 3;
+constexpr uint32_t annotation_int_value = 4;
+constexpr uint32_t annotation_double_value = 5;
+constexpr uint32_t annotation_string_value = 6;
+constexpr uint32_t annotation_legacy_json_value = 9;
+constexpr uint32_t annotation_name = 10;
+
+constexpr uint32_t interned_event_names = 2;
+constexpr uint32_t event_name_iid_field = 1;
+constexpr uint32_t event_name_name = 2;
+
+constexpr uint64_t wire_varint = 0;
+constexpr uint64_t wire_fixed64 = 1;
+constexpr uint64_t wire_length_delimited = 2;
+} // namespace proto
+
+constexpr size_t max_varint_size = 10;
+
+static size_t encodeVarint(uint64_t value, char *out) {
+    size_t size = 0;
+    while (value >= 0x80) {
+        out[size++] = static_cast<char>(value | 0x80);
+        value >>= 7;
+    }
+    out[size++] = static_cast<char>(value);
+    return size;
+}
+
+// ============================================================================
+// ============================== Message =====================================
+// ============================================================================
+
+void PerfettoTraceWriter::Message::varint(uint32_t field, uint64_t value) {
+    putVarint((uint64_t(field) << 3) | proto::wire_varint);
+    putVarint(value);
+}
+
+void PerfettoTraceWriter::Message::fixed64(uint32_t field, uint64_t value) {
+    putVarint((uint64_t(field) << 3) | proto::wire_fixed64);
+    for (int byte = 0; byte < 8; byte++) {
+        bytes.push_back(static_cast<char>(value >> (8 * byte)));
+    }
+}
+
+void PerfettoTraceWriter::Message::string(uint32_t field, std::string_view value) {
+    putVarint((uint64_t(field) << 3) | proto::wire_length_delimited);
+    putVarint(value.size());
+    bytes.insert(bytes.end(), value.begin(), value.end());
+}
+
+void PerfettoTraceWriter::Message::putVarint(uint64_t value) {
+    char encoded[max_varint_size];
+    bytes.insert(bytes.end(), encoded, encoded + encodeVarint(value, encoded));
+}
+
+// ============================================================================
+// ============================== Writer ======================================
+// ============================================================================
+
+PerfettoTraceWriter::PerfettoTraceWriter(const std::string &filename) : output(filename) {}
+
+PerfettoTraceWriter::PerfettoTraceWriter(uint64_t sequence_id) : sequence_id(sequence_id) {}
+
+PerfettoTraceWriter::~PerfettoTraceWriter() { writeSlices(); }
+
+void PerfettoTraceWriter::completeEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t start_ns, int64_t duration_ns,
+                                        std::string_view args) {
+    addSlice(name, pid, tid, start_ns, start_ns + duration_ns, args);
+}
+
+void PerfettoTraceWriter::unfinishedEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t start_ns, std::string_view args) {
+    addSlice(name, pid, tid, start_ns, -1, args);
+}
+
+// Counters do not nest, so their samples are written right away.
+void PerfettoTraceWriter::counterEvent(std::string_view name, uint32_t pid, int64_t, int64_t time_ns, double value) {
+    track_event.clear();
+    track_event.varint(proto::event_track_uuid, counterTrack(pid, name));
+    track_event.varint(proto::event_type, proto::type_counter);
+    track_event.fixed64(proto::event_double_counter_value, std::bit_cast<uint64_t>(value));
+
+    packet.clear();
+    packet.varint(proto::packet_timestamp, static_cast<uint64_t>(time_ns));
+    packet.message(proto::packet_track_event, track_event);
+    writePacket(0);
+}
+
+// Instant events do not nest either. Their name is written inline, so they
+// do not depend on the interning of the pending slices.
+void PerfettoTraceWriter::instantEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t time_ns, char scope) {
+    uint64_t track = scope == 'g' ? globalTrack() : scope == 'p' ? pid : threadTrack(pid, tid);
+    track_event.clear();
+    track_event.varint(proto::event_track_uuid, track);
+    track_event.varint(proto::event_type, proto::type_instant);
+    track_event.string(proto::event_name, name);
+
+    packet.clear();
+    packet.varint(proto::packet_timestamp, static_cast<uint64_t>(time_ns));
+    packet.message(proto::packet_track_event, track_event);
+    writePacket(0);
+}
+
+void PerfettoTraceWriter::flowEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t time_ns, char phase, uint64_t id) {
+    setSlicesTrack(threadTrack(pid, tid));
+    flows.push_back(Flow{time_ns, id, internName(name), phase == 'f', 0});
+}
+
+// Async spans overlap each other, so each one gets its own track, described
+// along its begin.
+void PerfettoTraceWriter::asyncEvent(std::string_view name, std::string_view category, uint32_t pid, int64_t, int64_t time_ns,
+                                     char phase, uint64_t id) {
+    uint64_t track = hashTrack((id * 0x9e3779b97f4a7c15) ^ pid, category);
+    track_event.clear();
+    track_event.varint(proto::event_track_uuid, track);
+    if (phase == 'b') {
+        describeTrack(track, pid, name, false);
+        track_event.varint(proto::event_type, proto::type_slice_begin);
+        track_event.string(proto::event_categories, category);
+        track_event.string(proto::event_name, name);
+    } else {
+        track_event.varint(proto::event_type, proto::type_slice_end);
+    }
+
+    packet.clear();
+    packet.varint(proto::packet_timestamp, static_cast<uint64_t>(time_ns));
+    packet.message(proto::packet_track_event, track_event);
+    writePacket(0);
+}
+
+// Samples are instant events of their thread named by the sampled function,
+// with the whole stack, one frame per line, in a debug annotation.
+void PerfettoTraceWriter::sampleEvent(uint32_t pid, int64_t tid, int64_t time_ns, const std::vector<std::string_view> &frames) {
+    std::string stack;
+    for (std::string_view frame : frames) {
+        stack.append(frame).push_back('\n');
+    }
+
+    track_event.clear();
+    track_event.varint(proto::event_track_uuid, threadTrack(pid, tid));
+    track_event.varint(proto::event_type, proto::type_instant);
+    track_event.string(proto::event_name, frames.empty() ? std::string_view("(unknown)") : frames.back());
+    annotation.clear();
+    annotation.string(proto::annotation_name, "stack");
+    annotation.string(proto::annotation_string_value, stack);
+    track_event.message(proto::event_debug_annotations, annotation);
+
+    packet.clear();
+    packet.varint(proto::packet_timestamp, static_cast<uint64_t>(time_ns));
+    packet.message(proto::packet_track_event, track_event);
+    writePacket(0);
+}
+
+void PerfettoTraceWriter::processMetadata(uint32_t pid, std::string_view name, int) {
+    entity.clear();
+    entity.varint(proto::process_pid, pid);
+    entity.string(proto::process_name, name);
+
+    descriptor.clear();
+    descriptor.varint(proto::track_uuid, pid);
+    descriptor.message(proto::track_process, entity);
+
+    packet.clear();
+    packet.message(proto::packet_track_descriptor, descriptor);
+    writePacket(0);
+}
+
+void PerfettoTraceWriter::threadMetadata(uint32_t pid, int64_t tid, std::string_view name, int) {
+    entity.clear();
+    entity.varint(proto::thread_pid, pid);
+    entity.varint(proto::thread_tid, static_cast<uint64_t>(tid));
+    entity.string(proto::thread_name, name);
+
+    descriptor.clear();
+    descriptor.varint(proto::track_uuid, threadTrack(pid, tid));
+    descriptor.varint(proto::track_parent_uuid, pid);
+    descriptor.message(proto::track_thread, entity);
+
+    packet.clear();
+    packet.message(proto::packet_track_descriptor, descriptor);
+    writePacket(0);
+}
+
+void PerfettoTraceWriter::flush() {
+    writeSlices();
+    output.flush();
+}
+
+std::unique_ptr<TraceWriter> PerfettoTraceWriter::fragment() {
+    return std::unique_ptr<PerfettoTraceWriter>(new PerfettoTraceWriter(next_sequence_id++));
+}
+
+// Packets of different sequences can be freely interleaved, so appending a
+// fragment is a plain copy.
+void PerfettoTraceWriter::append(TraceWriter &fragment) {
+    auto &packets = static_cast<PerfettoTraceWriter &>(fragment);
+    packets.writeSlices();
+    output.put(packets.output.take());
+}
+
+// Uuid of a track identified by `seed` and `key`, with the high bit set so it
+// does not collide with the process and thread tracks.
+uint64_t PerfettoTraceWriter::hashTrack(uint64_t seed, std::string_view key) {
+    uint64_t uuid = 0xcbf29ce484222325 ^ seed;
+    for (char c : key) {
+        uuid = (uuid ^ static_cast<unsigned char>(c)) * 0x100000001b3;
+    }
+    return uuid | (uint64_t(1) << 63);
+}
+
+// Counter tracks are identified by a hash of their process and name, so
+// fragments describing the same counter share its track.
+uint64_t PerfettoTraceWriter::counterTrack(uint32_t pid, std::string_view name) {
+    uint64_t uuid = hashTrack(pid, name);
+    if (counter_tracks.insert(uuid).second) {
+        describeTrack(uuid, pid, name, true);
+    }
+    return uuid;
+}
+
+void PerfettoTraceWriter::describeTrack(uint64_t uuid, uint64_t parent_uuid, std::string_view name, bool counter) {
+    descriptor.clear();
+    descriptor.varint(proto::track_uuid, uuid);
+    descriptor.varint(proto::track_parent_uuid, parent_uuid);
+    descriptor.string(proto::track_name, name);
+    if (counter) {
+        entity.clear();
+        descriptor.message(proto::track_counter, entity);
+    }
+
+    packet.clear();
+    packet.message(proto::packet_track_descriptor, descriptor);
+    writePacket(0);
+}
+
+// Root track of the events marking the whole trace.
+uint64_t PerfettoTraceWriter::globalTrack() {
+    constexpr uint64_t uuid = uint64_t(1) << 62;
+    if (global_track) {
+        return uuid;
+    }
+    global_track = true;
+
+    descriptor.clear();
+    descriptor.varint(proto::track_uuid, uuid);
+    descriptor.string(proto::track_name, "Global");
+
+    packet.clear();
+    packet.message(proto::packet_track_descriptor, descriptor);
+    writePacket(0);
+    return uuid;
+}
+
+void PerfettoTraceWriter::setSlicesTrack(uint64_t track) {
+    if (track != slices_track) {
+        writeSlices();
+        slices_track = track;
+    }
+}
+
+// New names are interned by the next event packet, written before any event
+// using them.
+uint64_t PerfettoTraceWriter::internName(std::string_view name) {
+    auto name_it = event_names.find(name);
+    if (name_it == event_names.end()) {
+        name_it = event_names.emplace(name, event_names.size() + 1).first;
+        entity.clear();
+        entity.varint(proto::event_name_iid_field, name_it->second);
+        entity.string(proto::event_name_name, name);
+        interned_names.message(proto::interned_event_names, entity);
+    }
+    return name_it->second;
+}
+
+void PerfettoTraceWriter::addSlice(std::string_view name, uint32_t pid, int64_t tid, int64_t start_ns, int64_t end_ns,
+                                   std::string_view args) {
+    setSlicesTrack(threadTrack(pid, tid));
+    uint64_t name_iid = internName(name);
+
+    auto args_it = args_ids.find(args);
+    if (args_it == args_ids.end()) {
+        args_it = args_ids.emplace(args, args_table.size()).first;
+        args_table.push_back(args_it->first);
+    }
+
+    slices.push_back(Slice{start_ns, end_ns, name_iid, args_it->second});
+}
+
+// Attaches each flow step to the innermost of the sorted slices enclosing it,
+// then groups the flows by slice.
+void PerfettoTraceWriter::attachFlows() {
+    constexpr size_t no_slice = std::numeric_limits<size_t>::max();
+    auto end_of = [](const Slice &slice) { return slice.end < 0 ? std::numeric_limits<int64_t>::max() : slice.end; };
+    std::sort(flows.begin(), flows.end(), [](const Flow &a, const Flow &b) { return a.time < b.time; });
+
+    std::vector<size_t> open;
+    size_t next_flow = 0;
+    auto attach_until = [&](int64_t time) {
+        for (; next_flow < flows.size() && flows[next_flow].time < time; next_flow++) {
+            while (!open.empty() && end_of(slices[open.back()]) < flows[next_flow].time) {
+                open.pop_back();
+            }
+            flows[next_flow].slice = open.empty() ? no_slice : open.back();
+        }
+    };
+    for (size_t index = 0; index < slices.size(); index++) {
+        attach_until(slices[index].start);
+        while (!open.empty() && end_of(slices[open.back()]) <= slices[index].start) {
+            open.pop_back();
+        }
+        open.push_back(index);
+    }
+    attach_until(std::numeric_limits<int64_t>::max());
+
+    std::stable_sort(flows.begin(), flows.end(), [](const Flow &a, const Flow &b) { return a.slice < b.slice; });
+    for (size_t begin = 0, end = 0; begin < flows.size() && flows[begin].slice != no_slice; begin = end) {
+        while (end < flows.size() && flows[end].slice == flows[begin].slice) {
+            end++;
+        }
+        slices[flows[begin].slice].flows_begin = static_cast<uint32_t>(begin);
+        slices[flows[begin].slice].flows_end = static_cast<uint32_t>(end);
+    }
+}
+
+// Events are written in the order they happened, so entries completed
+// children first are sorted back into their nesting order: by start, outer
+// slices before the ones they contain, each end before the next begin.
+void PerfettoTraceWriter::writeSlices() {
+    auto end_of = [](const Slice &slice) { return slice.end < 0 ? std::numeric_limits<int64_t>::max() : slice.end; };
+    std::sort(slices.begin(), slices.end(), [&](const Slice &a, const Slice &b) {
+        return a.start != b.start ? a.start < b.start : end_of(a) > end_of(b);
+    });
+    attachFlows();
+
+    std::vector<const Slice *> open;
+    for (const Slice &slice : slices) {
+        while (!open.empty() && end_of(*open.back()) <= slice.start) {
+            writeSliceEvent(slices_track, open.back()->end, nullptr);
+            open.pop_back();
+        }
+        writeSliceEvent(slices_track, slice.start, &slice);
+        open.push_back(&slice);
+    }
+    for (; !open.empty(); open.pop_back()) {
+        if (open.back()->end >= 0) {
+            writeSliceEvent(slices_track, open.back()->end, nullptr);
+        }
+    }
+
+    // Flows without an enclosing slice, whose profile point is written with
+    // a later flush, are kept as instant events of the thread.
+    for (const Flow &flow : flows) {
+        if (flow.slice == std::numeric_limits<size_t>::max()) {
+            track_event.clear();
+            track_event.varint(proto::event_track_uuid, slices_track);
+            track_event.varint(proto::event_type, proto::type_instant);
+            track_event.varint(proto::event_name_iid, flow.name_iid);
+            writeFlowIds(&flow, &flow + 1);
+            writeTrackEvent(flow.time);
+        }
+    }
+    slices.clear();
+    flows.clear();
+    args_ids.clear();
+    args_table.clear();
+}
+
+// Writes a slice begin event of `begin`, or an end event if null.
+void PerfettoTraceWriter::writeSliceEvent(uint64_t track, int64_t timestamp, const Slice *begin) {
+    track_event.clear();
+    track_event.varint(proto::event_track_uuid, track);
+    if (begin != nullptr) {
+        track_event.varint(proto::event_type, proto::type_slice_begin);
+        track_event.varint(proto::event_name_iid, begin->name_iid);
+
+        std::string_view args = args_table[begin->args];
+        if (args != "{}") {
+            writeArgs(args);
+        }
+        writeFlowIds(flows.data() + begin->flows_begin, flows.data() + begin->flows_end);
+    } else {
+        track_event.varint(proto::event_type, proto::type_slice_end);
+    }
+    writeTrackEvent(timestamp);
+}
+
+// Writes the members of the args object as typed debug annotations, nested
+// values as JSON text. Args read back from a damaged file that are not an
+// object are kept as a single string annotation.
+void PerfettoTraceWriter::writeArgs(std::string_view args) {
+    using json = nlohmann::json;
+    json object = json::parse(args.begin(), args.end(), nullptr, false);
+    if (!object.is_object()) {
+        annotation.clear();
+        annotation.string(proto::annotation_name, "args");
+        annotation.string(proto::annotation_string_value, args);
+        track_event.message(proto::event_debug_annotations, annotation);
+        return;
+    }
+    for (const auto &[key, value] : object.items()) {
+        annotation.clear();
+        annotation.string(proto::annotation_name, key);
+        switch (value.type()) {
+        case json::value_t::number_integer:
+            annotation.varint(proto::annotation_int_value, static_cast<uint64_t>(value.get<int64_t>()));
+            break;
+        case json::value_t::number_unsigned:
+            annotation.varint(proto::annotation_uint_value, value.get<uint64_t>());
+            break;
+        case json::value_t::number_float:
+            annotation.fixed64(proto::annotation_double_value, std::bit_cast<uint64_t>(value.get<double>()));
+            break;
+        case json::value_t::boolean:
+            annotation.varint(proto::annotation_bool_value, value.get<bool>());
+            break;
+        case json::value_t::string:
+            annotation.string(proto::annotation_string_value, value.get_ref<const std::string &>());
+            break;
+        default:
+            annotation.string(proto::annotation_legacy_json_value, value.dump());
+            break;
+        }
+        track_event.message(proto::event_debug_annotations, annotation);
+    }
+}
+
+void PerfettoTraceWriter::writeFlowIds(const Flow *begin, const Flow *end) {
+    for (const Flow *flow = begin; flow != end; flow++) {
+        track_event.fixed64(flow->terminating ? proto::event_terminating_flow_ids : proto::event_flow_ids, flow->id);
+    }
+}
+
+// Writes `track_event` with the names interned meanwhile.
+void PerfettoTraceWriter::writeTrackEvent(int64_t timestamp) {
+    packet.clear();
+    packet.varint(proto::packet_timestamp, static_cast<uint64_t>(timestamp));
+    packet.message(proto::packet_track_event, track_event);
+    if (!interned_names.empty()) {
+        packet.message(proto::packet_interned_data, interned_names);
+        interned_names.clear();
+    }
+    writePacket(proto::seq_needs_incremental_state);
+}
+
+// Writes `packet` on the trace sequence, clearing the interning state of the
+// sequence with the first one.
+void PerfettoTraceWriter::writePacket(uint64_t sequence_flags) {
+    packet.varint(proto::packet_sequence_id, sequence_id);
+    if (!state_cleared) {
+        sequence_flags |= proto::seq_incremental_state_cleared;
+        state_cleared = true;
+    }
+    if (sequence_flags != 0) {
+        packet.varint(proto::packet_sequence_flags, sequence_flags);
+    }
+
+    // Packets are the repeated field of the Trace message, so the file can be
+    // streamed one packet at a time.
+    char header[1 + max_varint_size] = {static_cast<char>((proto::trace_packet << 3) | proto::wire_length_delimited)};
+    size_t header_size = 1 + encodeVarint(packet.data().size(), header + 1);
+    output.put(std::string_view(header, header_size));
+    output.put(packet.data());
+}
+
+} // namespace _profiler
+
+#endif // TRACY_ENABLE
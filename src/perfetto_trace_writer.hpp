@@ -0,0 +1,165 @@
+//===--- perfetto_trace_writer.hpp - Perfetto protobuf trace writer ------===//
+//
+// Declarations of a writer that streams events as Perfetto TracePacket
+// protobuf messages, without depending on the Perfetto SDK.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef _PERFETTO_TRACE_WRITER_H
+#define _PERFETTO_TRACE_WRITER_H
+
+#ifdef TRACY_ENABLE
+
+#include "trace_writer.hpp"
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace _profiler {
+
+/// Extension of the Perfetto trace files.
+inline constexpr std::string_view perfetto_trace_extension = ".pftrace";
+
+/// Streaming writer of the Perfetto protobuf trace format.
+///
+/// Processes and threads are described by track descriptors and profile
+/// points become slice begin and end events on their thread track, with
+/// interned names. Counters get a track of their process, instant events the
+/// track of their scope, global ones a root track, and each async span a track
+/// of its process. The events of a
+/// thread are kept until another thread writes an event or the writer is
+/// flushed, then written in nesting order, flows attached to the slices
+/// enclosing them.
+/// Fragments write on their own packet sequence, with their own interning.
+class PerfettoTraceWriter : public TraceWriter {
+public:
+    /// Open \p filename for writing.
+    explicit PerfettoTraceWriter(const std::string &filename);
+
+    /// Write the pending events and close the file.
+    ~PerfettoTraceWriter() override;
+
+    bool isOpen() const override { return output.isOpen(); }
+
+    void completeEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t start_ns, int64_t duration_ns,
+                       std::string_view args) override;
+
+    void unfinishedEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t start_ns, std::string_view args) override;
+
+    void counterEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t time_ns, double value) override;
+
+    void instantEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t time_ns, char scope) override;
+
+    void flowEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t time_ns, char phase, uint64_t id) override;
+
+    void asyncEvent(std::string_view name, std::string_view category, uint32_t pid, int64_t tid, int64_t time_ns, char phase,
+                    uint64_t id) override;
+
+    void sampleEvent(uint32_t pid, int64_t tid, int64_t time_ns, const std::vector<std::string_view> &frames) override;
+
+    void processMetadata(uint32_t pid, std::string_view name, int sort_index) override;
+
+    void threadMetadata(uint32_t pid, int64_t tid, std::string_view name, int sort_index) override;
+
+    void flush() override;
+
+    std::unique_ptr<TraceWriter> fragment() override;
+
+    void append(TraceWriter &fragment) override;
+
+private:
+    /// Fragment of the trace, written on \p sequence_id.
+    explicit PerfettoTraceWriter(uint64_t sequence_id);
+
+    // Protobuf message encoded into a reusable buffer.
+    class Message {
+    public:
+        void clear() { bytes.clear(); }
+        bool empty() const { return bytes.empty(); }
+        std::string_view data() const { return std::string_view(bytes.data(), bytes.size()); }
+
+        void varint(uint32_t field, uint64_t value);
+        void fixed64(uint32_t field, uint64_t value);
+        void string(uint32_t field, std::string_view value);
+        void message(uint32_t field, const Message &value) { string(field, value.data()); }
+
+    private:
+        void putVarint(uint64_t value);
+
+        std::vector<char> bytes;
+    };
+
+    // Profile point of the pending thread.
+    struct Slice {
+        int64_t start;            // Begin timestamp
+        int64_t end;              // End timestamp, -1 if unfinished
+        uint64_t name_iid;        // Interned name
+        uint32_t args;            // Index of the args in `args_table`
+        uint32_t flows_begin = 0; // Attached range of `flows`
+        uint32_t flows_end = 0;
+    };
+
+    // Flow step of the pending thread.
+    struct Flow {
+        int64_t time;      // Timestamp of the step
+        uint64_t id;       // Flow id
+        uint64_t name_iid; // Interned name
+        bool terminating;  // Whether the step ends the flow
+        size_t slice;      // Index of the enclosing slice, if any
+    };
+
+    struct StringHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view str) const { return std::hash<std::string_view>{}(str); }
+    };
+
+    static uint64_t threadTrack(uint32_t pid, int64_t tid) { return (uint64_t(pid) << 32) | uint32_t(tid); }
+    static uint64_t hashTrack(uint64_t seed, std::string_view key);
+
+    uint64_t counterTrack(uint32_t pid, std::string_view name);
+    uint64_t globalTrack();
+    void describeTrack(uint64_t uuid, uint64_t parent_uuid, std::string_view name, bool counter);
+
+    void setSlicesTrack(uint64_t track);
+    uint64_t internName(std::string_view name);
+    void addSlice(std::string_view name, uint32_t pid, int64_t tid, int64_t start_ns, int64_t end_ns, std::string_view args);
+    void attachFlows();
+    void writeSlices();
+    void writeSliceEvent(uint64_t track, int64_t timestamp, const Slice *begin);
+    void writeArgs(std::string_view args);
+    void writeFlowIds(const Flow *begin, const Flow *end);
+    void writeTrackEvent(int64_t timestamp);
+    void writePacket(uint64_t sequence_flags);
+
+    TraceOutput output;
+    uint64_t sequence_id = 1;      // Packet sequence of the events
+    uint64_t next_sequence_id = 2; // Sequence of the next fragment
+    bool state_cleared = false;
+
+    // Interning of the event names, emitted along the first event using them.
+    std::unordered_map<std::string, uint64_t, StringHash, std::equal_to<>> event_names;
+    Message interned_names;
+
+    // Distinct args of the pending slices, released once they are written.
+    std::unordered_map<std::string, uint32_t, StringHash, std::equal_to<>> args_ids;
+    std::vector<std::string_view> args_table;
+
+    std::vector<Slice> slices; // Events of the pending thread
+    std::vector<Flow> flows;   // Flow steps of the pending thread
+    uint64_t slices_track = 0;
+
+    std::unordered_set<uint64_t> counter_tracks; // Described counter tracks
+    bool global_track = false;                   // Described global track
+
+    // Scratch messages reused for every packet.
+    Message packet, track_event, annotation, descriptor, entity, interned;
+};
+
+} // namespace _profiler
+
+#endif // TRACY_ENABLE
+
+#endif // _PERFETTO_TRACE_WRITER_H
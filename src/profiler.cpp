@@ -12,28 +12,75 @@
 #ifdef TRACY_ENABLE
 
 #include "profiler.hpp"
-#include <fstream>
-#include <iomanip>
+#include "binary_trace.hpp"
+#include "chrome_trace_writer.hpp"
+#include "perfetto_trace_writer.hpp"
 #include <iostream>
 #include <stdint.h>
 #include <stdio.h>
 
 #include <algorithm>
+#include <atomic>
+#include <bit>
+#include <charconv>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <limits>
 #include <list>
+#include <memory>
 #include <mutex>
 #include <ratio>
-#include <stack>
+#include <span>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include <cassert>
 #include <cctype>
+#include <cmath>
+#include <csignal>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#ifdef _WIN32
 #include <windows.h>
 
 #include <processthreadsapi.h>
+#else
+#include <semaphore.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <cerrno>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <ucontext.h>
+// Older glibc only name the thread of SIGEV_THREAD_ID through the union.
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#endif
+
+#if defined(_M_X64)
+#include <intrin.h>
+#define PROF_HAS_TSC
+#elif defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define PROF_HAS_TSC
+#endif
 
 #include <json/json.hpp>
 
@@ -43,61 +90,832 @@ namespace _profiler {
 // =============================================================================
 constexpr char default_process_name[] = "Worker Process";
 constexpr char default_thread_name[] = "Worker Thread";
+// Bytes allocated at once to store completed entries of a thread.
+constexpr size_t entry_chunk_bytes = 64 * 1024;
+// Deepest nesting of active entries recorded on a thread.
+constexpr size_t max_stack_depth = 256;
+// Default bound of the memory used by the completed entries of a thread.
+constexpr size_t default_buffer_size_mb = 256;
+// Zone statistics histograms: durations below 2^duration_sub_bits ticks are
+// counted exactly, longer ones in 2^duration_sub_bits buckets per power of
+// two (12.5% wide), up to 2^duration_max_bits ticks.
+constexpr unsigned duration_sub_bits = 3;
+constexpr unsigned duration_max_bits = 48;
+// Stack samples kept by each thread between two drains, and deepest stack
+// captured by a sample.
+constexpr size_t sample_buffer_size = 4096;
+constexpr size_t max_sample_depth = 32;
+// Performance counters measured per zone, in the order of their deltas, as
+// named in the trace args and the statistics.
+constexpr const char *perf_counter_names[] = {"task_clock_ns", "context_switches", "page_faults",
+                                              "cycles",        "instructions",     "cache_misses"};
+constexpr size_t max_perf_counters = std::size(perf_counter_names);
+// Typed arguments recorded per profile point, bytes kept of their keys and
+// strings and of details, and records stacked by the active entries of a
+// thread.
+constexpr size_t max_zone_args = 16;
+constexpr size_t max_arg_key = 60;
+constexpr size_t max_arg_string = 60;
+constexpr size_t max_details = 16 * 1024;
+constexpr size_t max_arg_records = 4096;
+
+// Environment variables:
+// - GP_PROFILE_LEVEL: hexadecimal mask of the collected profile levels.
+// - GP_FILENAME_PREFIX: prefix of the dumped trace file.
+// - GP_FLUSH_INTERVAL_MS: when set, a background thread appends completed
+//   entries to the trace file at this period instead of keeping them in
+//   memory until dumpTracingFile().
+// - GP_BUFFER_SIZE_MB: bound of the memory used by the completed entries of
+//   each thread, their details and typed arguments included. Entries are
+//   dropped and counted once it is full.
+// - GP_FLIGHT_RECORDER_S: when set, full thread buffers overwrite their oldest
+//   entries, along with their details, and only the last given seconds are
+//   dumped. Disables the flusher.
+// - GP_SNAPSHOT_SIGNAL: when set, SIGUSR1 dumps a snapshot of the trace.
+// - GP_ZONE_STATS: when set, the duration of every zone is aggregated into
+//   per-zone statistics, written next to the trace file by dumpTracingFile().
+//   "only" skips the timeline, so memory stays constant however long it runs.
+// - GP_CLOCK: "tsc" timestamps entries with the invariant TSC when the CPU
+//   provides one, instead of steady_clock.
+// - GP_TRACE_FORMAT: "binary" dumps the compact binary format, converted to
+//   JSON offline by RotProfilerConverter, and "perfetto" the Perfetto protobuf
+//   format, instead of Chrome Trace JSON.
+// - GP_DUMP_THREADS: number of threads serializing the trace into fragments of
+//   a few thousand events, appended as they complete. Defaults to the
+//   hardware concurrency.
+// - GP_TRACE_COMPRESSION: "gzip" or "zstd" compresses the trace files while
+//   they are written, when the library was found at build time.
+// - GP_SAMPLE_INTERVAL_US: when set, the call stacks of the instrumented
+//   threads are sampled every given microseconds of their CPU time (Linux on
+//   x86-64 and AArch64), at most once per kernel tick. Each thread keeps up to
+//   4096 samples until they are flushed or dumped. Stacks are walked through
+//   the frame pointers, so code built without them shows truncated stacks.
+//   Executables need to export their symbols (-rdynamic) for their functions
+//   to be named, otherwise frames show as "module+offset".
+// - GP_PERF_COUNTERS: when set, every zone counts its task clock, context
+//   switches and page faults, and its cycles, instructions and cache misses
+//   when the kernel exposes them (Linux only). The deltas are added to the
+//   trace args and to the zone statistics. Each profile point then costs two
+//   read() system calls.
+// - GP_THREAD_CPU_TIME: when set, every zone measures the CPU time of its
+//   thread next to its wall time, so the trace args and the zone statistics
+//   tell the time spent on the CPU from the time descheduled or blocked.
+//   Each profile point then reads the thread CPU clock twice, a system call on
+//   Linux; RotProfilerRecordBenchmark measures the cost. Windows only updates
+//   it every scheduler tick.
+// - GP_ALLOC_TRACKING: when set, heap allocations and frees are counted in the
+//   statistics of the innermost active zone of their thread, which enables
+//   the zone statistics. Needs a build defining PROF_TRACK_ALLOCATIONS, which
+//   replaces operator new and delete. "counter" also records the heap bytes
+//   allocated and not freed since the profiler started into a "Heap bytes"
+//   counter whenever a profile point ends.
 
 // Profiler structures.
 // =============================================================================
 // Profile entry that measure the time between two points in the program.
 namespace chrono = std::chrono;
-using ProfilerDuration = chrono::duration<double, std::micro>;
 
 // Convenient wrapper for Process LLVM Lib
 namespace id {
 struct Process {
     using Pid = unsigned int;
+#ifdef _WIN32
     static unsigned int getProcessId() { return GetCurrentProcessId(); }
+#else
+    static unsigned int getProcessId() { return static_cast<unsigned int>(getpid()); }
+#endif
 };
 
 // Convenient wrapper for Threading LLVM Lib
 struct Thread {
     using Tid = unsigned int;
+#ifdef _WIN32
     static unsigned int getThreadId() { return GetCurrentThreadId(); }
+#else
+    // gettid() is a system call, so it is only issued once per thread.
+    static unsigned int getThreadId() {
+        static thread_local unsigned int tid = static_cast<unsigned int>(syscall(SYS_gettid));
+        return tid;
+    }
+#endif
 };
 } // namespace id
 
+// Clock of the recorded entries. Its ticks are steady_clock nanoseconds or,
+// when `use_tsc` is set, TSC cycles converted by toProfileScale() at dump time.
 struct ProfilerClock {
     using duration = chrono::nanoseconds;
     using rep = duration::rep;
     using period = duration::period;
-    using time_point = chrono::time_point<chrono::steady_clock>;
+    using time_point = chrono::time_point<chrono::steady_clock, duration>;
 
     static const bool is_steady = false;
 
+    static inline std::atomic<bool> use_tsc = false;
+
     static time_point now() noexcept { return chrono::steady_clock::now(); }
+    static rep ticks() noexcept {
+#ifdef PROF_HAS_TSC
+        if (use_tsc.load(std::memory_order_relaxed)) {
+            return static_cast<rep>(__rdtsc());
+        }
+#endif
+        return now().time_since_epoch().count();
+    }
+};
+
+// CPU time consumed by the calling thread, in nanoseconds. Unlike the
+// ProfilerClock, it stands still while the thread is not running.
+struct ThreadCpuClock {
+    static int64_t nanoseconds() noexcept {
+#ifdef _WIN32
+        FILETIME creation, exit, kernel, user;
+        GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user);
+        auto hundred_ns = [](FILETIME time) { return int64_t(time.dwHighDateTime) << 32 | time.dwLowDateTime; };
+        return (hundred_ns(kernel) + hundred_ns(user)) * 100;
+#else
+        timespec time;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+        return int64_t(time.tv_sec) * 1'000'000'000 + time.tv_nsec;
+#endif
+    }
+};
+
+// Mapping of TSC cycles to steady_clock nanoseconds. The reference point is
+// taken when the TSC is enabled and the rate is refined against it every time
+// entries are converted, so it gets more precise as the run goes on.
+struct TscCalibration {
+    std::mutex mtx;
+    ProfilerClock::rep tsc_base = 0;        // TSC at the reference point
+    ProfilerClock::rep ns_base = 0;         // steady_clock at the reference point
+    std::atomic<double> ns_per_cycle = 1.0; // Measured rate
+};
+
+// Kind of a recorded entry, kept in the high bits of Entry::zone. Profile
+// points are kind 0, so their entries hold a plain ZoneId. Details, typed
+// arguments, perf deltas and CPU times are pushed along with the profile
+// point that follows them.
+enum class EntryKind : uint32_t {
+    zone = 0,        // Profile point from `start` to `end`
+    counter = 1,     // Sample at `start` of the double stored in `end`
+    instant = 2,     // Event at `start`, of the InstantScope stored in `details`
+    flow = 3,        // Step at `start` of the FlowId in `end`, FlowPhase in `details`
+    async_begin = 4, // Begin at `start` of the span with id `end`, category in `details`
+    async_end = 5,   // End at `start` of the span with id `end`, category in `details`
+    perf = 6,        // Deltas of the perf counters 2 * `details` and next in `start` and `end`
+    cpu_time = 7,    // Thread CPU time of the profile point in `start`, in nanoseconds
+    arg = 8,         // Argument of the ArgType and key length in `details`, value in `end`
+    arg_text = 9,    // Next bytes of the key and string of an argument, or of details, in all the fields
+    details = 10,    // Details of `end` bytes, the first ones in `start`
 };
+constexpr unsigned entry_kind_shift = 24;
+constexpr ZoneId max_zones = ZoneId(1) << entry_kind_shift;
 
+// Fixed-size record of a profile point or of another kind of event. It is
+// kept trivially copyable so entries can be stored in raw chunks and copied
+// without touching the heap.
 struct Entry {
-    std::string name = "";    // Timeline label
-    std::string details = ""; // Detailed description
-    ProfilerClock::time_point start = ProfilerClock::time_point();
-    ProfilerClock::time_point end = ProfilerClock::time_point();
+    ProfilerClock::rep start = 0; // Start timestamp in clock ticks
+    ProfilerClock::rep end = 0;   // End timestamp in clock ticks, or payload
+    ZoneId zone = 0;              // Registered zone descriptor and kind
+    uint32_t details = 0;         // Argument records while active, or payload
+
+    static Entry make(EntryKind kind, ZoneId zone, ProfilerClock::rep start, ProfilerClock::rep payload) {
+        return Entry{start, payload, (static_cast<uint32_t>(kind) << entry_kind_shift) | zone, 0};
+    }
+
+    EntryKind kind() const { return static_cast<EntryKind>(zone >> entry_kind_shift); }
+    ZoneId zoneId() const { return zone & (max_zones - 1); }
+
+    // Time the entry was completed at.
+    ProfilerClock::rep time() const { return kind() == EntryKind::zone ? end : start; }
+};
+static_assert(std::is_trivially_copyable_v<Entry> && sizeof(Entry) == 24);
+
+// The key of an argument, followed by its value for strings, is copied into
+// the `start` of its arg entry then into as many arg_text entries as needed.
+// Details are copied the same way from their details entry.
+constexpr size_t arg_first_bytes = sizeof(Entry::start);
+constexpr size_t arg_text_bytes = sizeof(Entry::start) + sizeof(Entry::end) + sizeof(Entry::details);
+constexpr unsigned arg_key_shift = 8; // Of the key length in the `details` of arg entries
+
+// Allocations made by the profiler itself, or while an allocation is being
+// tracked, are kept out of the zone statistics.
+static thread_local bool untracked_allocations = false;
+
+struct UntrackedAllocations {
+    bool previous = std::exchange(untracked_allocations, true);
+
+    UntrackedAllocations() = default;
+    UntrackedAllocations(const UntrackedAllocations &) = delete;
+    UntrackedAllocations &operator=(const UntrackedAllocations &) = delete;
+    ~UntrackedAllocations() { untracked_allocations = previous; }
+};
+
+// Fixed-size block of completed entries.
+//
+// The owner thread is the only writer. `size` and `next` are published with
+// release semantics, so the filled part of a chunk can be read while the owner
+// keeps appending to it.
+struct EntryChunk {
+    static constexpr uint32_t capacity = (entry_chunk_bytes - 2 * sizeof(void *)) / sizeof(Entry);
+
+    std::atomic<EntryChunk *> next = nullptr; // Following chunk
+    std::atomic<uint32_t> size = 0;           // Entries written
+    Entry entries[capacity];
+};
+static_assert(sizeof(EntryChunk) <= entry_chunk_bytes);
+
+// Per-thread ring of completed entries.
+//
+// Entries are appended to linked chunks, so recording never reallocates nor
+// copies previously recorded entries. The owner thread produces entries while
+// a single consumer at a time (serialized by `read_mtx`) drains them. Drained
+// chunks are handed back to the owner through the lock-free `free_chunks`
+// list, so the chunks form a single-producer single-consumer ring where
+// neither side ever blocks the other. The ring grows lazily up to
+// `max_chunks`; past that, entries are dropped and counted until the consumer
+// frees some room or, when `overwrite` is set, the owner reclaims the oldest
+// chunk itself.
+struct EntryBuffer {
+    // Owner side.
+    EntryChunk *tail = nullptr;  // Chunk being filled
+    EntryChunk *spare = nullptr; // Recycled chunks ready to be filled
+    uint64_t chunks = 1;         // Chunks allocated
+    uint64_t max_chunks = 1;     // Bound of allocated chunks
+    bool overwrite = false;      // Reclaim the oldest chunk when full
+
+    // Consumer side, guarded by `read_mtx`.
+    std::mutex read_mtx;
+    EntryChunk *head = nullptr;         // Oldest chunk not fully drained
+    uint32_t read_index = 0;            // Entries of `head` already drained
+    uint64_t drained = 0;               // Entries drained so far
+    uint64_t overwritten = 0;           // Entries reclaimed before being drained
+    ProfilerClock::rep evicted_end = 0; // End of the last reclaimed entry
+
+    std::atomic<EntryChunk *> free_chunks = nullptr; // Drained chunks
+    std::atomic<uint64_t> bytes = 0;                 // Bytes reserved by all chunks
+    std::atomic<uint64_t> dropped = 0;               // Entries lost to a full ring
+
+    EntryBuffer() : tail(new EntryChunk), head(tail), bytes(sizeof(EntryChunk)) {}
+    EntryBuffer(const EntryBuffer &) = delete;
+    EntryBuffer &operator=(const EntryBuffer &) = delete;
+
+    ~EntryBuffer() {
+        for (EntryChunk *list : {head, spare, free_chunks.load(std::memory_order_acquire)}) {
+            while (list != nullptr) {
+                delete std::exchange(list, list->next.load(std::memory_order_relaxed));
+            }
+        }
+    }
+
+    void push(const Entry &entry) {
+        uint32_t size = tail->size.load(std::memory_order_relaxed);
+        if (size == EntryChunk::capacity) {
+            EntryChunk *chunk = takeChunk();
+            if (chunk == nullptr) {
+                // Only the owner writes the counter, no need for an atomic add.
+                dropped.store(dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                return;
+            }
+            tail->next.store(chunk, std::memory_order_release);
+            tail = chunk;
+            size = 0;
+        }
+        tail->entries[size] = entry;
+        tail->size.store(size + 1, std::memory_order_release);
+    }
+
+    // Room for `count` entries in the same chunk, published at once by
+    // commit() so that readers see either all or none of them. Null when the
+    // ring is full, the entries being dropped together.
+    Entry *reserve(uint32_t count) {
+        uint32_t size = tail->size.load(std::memory_order_relaxed);
+        if (size + count > EntryChunk::capacity) {
+            EntryChunk *chunk = takeChunk();
+            if (chunk == nullptr) {
+                dropped.store(dropped.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+                return nullptr;
+            }
+            tail->next.store(chunk, std::memory_order_release);
+            tail = chunk;
+            size = 0;
+        }
+        return tail->entries + size;
+    }
+
+    void commit(uint32_t count) { tail->size.store(tail->size.load(std::memory_order_relaxed) + count, std::memory_order_release); }
+
+    // Calls `func` for each entry completed since the previous drain, oldest
+    // first, and recycles the chunks that got fully drained.
+    template <typename Func>
+    void drain(Func &&func) {
+        std::unique_lock<std::mutex> read_lk(read_mtx);
+        while (true) {
+            uint32_t size = head->size.load(std::memory_order_acquire);
+            drained += size - read_index;
+            for (; read_index < size; ++read_index) {
+                func(head->entries[read_index]);
+            }
+
+            // The owner links the next chunk only after filling this one.
+            EntryChunk *next = head->next.load(std::memory_order_acquire);
+            if (next == nullptr) {
+                break;
+            }
+            recycleChunk(std::exchange(head, next));
+            read_index = 0;
+        }
+    }
+
+    // Calls `func` for each entry not drained yet, oldest first, leaving them
+    // in the buffer.
+    template <typename Func>
+    void forEach(Func &&func) {
+        std::unique_lock<std::mutex> read_lk(read_mtx);
+        uint32_t index = read_index;
+        for (EntryChunk *chunk = head; chunk != nullptr; chunk = chunk->next.load(std::memory_order_acquire), index = 0) {
+            uint32_t size = chunk->size.load(std::memory_order_acquire);
+            for (; index < size; ++index) {
+                func(chunk->entries[index]);
+            }
+        }
+    }
+
+    // Number of entries recorded so far, drained or not.
+    uint64_t count() {
+        std::unique_lock<std::mutex> read_lk(read_mtx);
+        uint64_t count = drained + overwritten - read_index;
+        for (EntryChunk *chunk = head; chunk != nullptr; chunk = chunk->next.load(std::memory_order_acquire)) {
+            count += chunk->size.load(std::memory_order_acquire);
+        }
+        return count;
+    }
+
+private:
+    EntryChunk *takeChunk() {
+        // Avoid a read-modify-write while the ring stays full.
+        if (spare == nullptr && free_chunks.load(std::memory_order_relaxed) != nullptr) {
+            spare = free_chunks.exchange(nullptr, std::memory_order_acquire);
+        }
+        if (spare == nullptr) {
+            if (chunks < max_chunks) {
+                UntrackedAllocations untracked;
+                ++chunks;
+                bytes.fetch_add(sizeof(EntryChunk), std::memory_order_relaxed);
+                return new EntryChunk;
+            }
+            return overwrite ? reclaimChunk() : nullptr;
+        }
+        EntryChunk *chunk = std::exchange(spare, spare->next.load(std::memory_order_relaxed));
+        chunk->next.store(nullptr, std::memory_order_relaxed);
+        chunk->size.store(0, std::memory_order_relaxed);
+        return chunk;
+    }
+
+    // Takes the oldest chunk back from the consumer side. It gives up rather
+    // than waiting when a consumer is reading the ring.
+    EntryChunk *reclaimChunk() {
+        std::unique_lock<std::mutex> read_lk(read_mtx, std::try_to_lock);
+        if (!read_lk.owns_lock() || head == tail) {
+            return nullptr;
+        }
+
+        EntryChunk *chunk = std::exchange(head, head->next.load(std::memory_order_relaxed));
+        uint32_t size = chunk->size.load(std::memory_order_relaxed);
+        overwritten += size - std::exchange(read_index, 0);
+        evicted_end = chunk->entries[size - 1].time();
+
+        chunk->next.store(nullptr, std::memory_order_relaxed);
+        chunk->size.store(0, std::memory_order_relaxed);
+        return chunk;
+    }
+
+    void recycleChunk(EntryChunk *chunk) {
+        EntryChunk *top = free_chunks.load(std::memory_order_relaxed);
+        do {
+            chunk->next.store(top, std::memory_order_relaxed);
+        } while (!free_chunks.compare_exchange_weak(top, chunk, std::memory_order_release, std::memory_order_relaxed));
+    }
+};
+
+// Duration distribution of a zone on one thread, in clock ticks.
+//
+// Only the owner thread writes it, with relaxed loads and stores rather than
+// read-modify-writes. Updates are framed by `version` like a seqlock: it is
+// odd while they are in progress, so readers can tell whether their copy is
+// consistent without ever blocking the owner.
+struct ZoneStats {
+    static constexpr size_t buckets_count = (duration_max_bits - duration_sub_bits + 1) << duration_sub_bits;
+
+    std::atomic<uint64_t> version = 0;
+    std::atomic<uint64_t> count = 0;
+    std::atomic<uint64_t> sum = 0;
+    std::atomic<uint64_t> min = std::numeric_limits<uint64_t>::max();
+    std::atomic<uint64_t> max = 0;
+    std::atomic<uint64_t> buckets[buckets_count] = {};
+    std::atomic<uint64_t> perf[max_perf_counters] = {}; // Sums of the perf counter deltas
+    std::atomic<uint64_t> cpu = 0;                      // Sum of the thread CPU times, in ns
+    std::atomic<uint64_t> allocations = 0;              // Heap allocations while innermost
+    std::atomic<uint64_t> allocated_bytes = 0;
+    std::atomic<uint64_t> frees = 0;                    // Heap frees while innermost
+    std::atomic<uint64_t> freed_bytes = 0;
+
+    // Shortest duration counted in `bucket`.
+    static uint64_t bucketStart(size_t bucket) {
+        if (bucket < (1u << duration_sub_bits)) {
+            return bucket;
+        }
+        unsigned shift = (bucket >> duration_sub_bits) - 1;
+        return ((1u << duration_sub_bits) | (bucket & ((1u << duration_sub_bits) - 1))) << shift;
+    }
+
+    static size_t bucket(uint64_t ticks) {
+        unsigned exponent = std::bit_width(ticks);
+        if (exponent <= duration_sub_bits) {
+            return ticks;
+        }
+        if (exponent > duration_max_bits) {
+            return buckets_count - 1;
+        }
+        unsigned shift = exponent - 1 - duration_sub_bits;
+        return ((shift + 1) << duration_sub_bits) + ((ticks >> shift) & ((1u << duration_sub_bits) - 1));
+    }
+
+    // Middle of the durations counted in `bucket`.
+    static double bucketValue(size_t bucket) {
+        if (bucket < (1u << duration_sub_bits)) {
+            return double(bucket);
+        }
+        unsigned shift = (bucket >> duration_sub_bits) - 1;
+        return double(bucketStart(bucket)) + double(uint64_t(1) << shift) / 2;
+    }
+
+    static void bump(std::atomic<uint64_t> &value, uint64_t delta) {
+        value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+
+    void record(uint64_t ticks, const uint64_t *perf_deltas = nullptr, uint64_t cpu_ns = 0) {
+        uint64_t updated = version.load(std::memory_order_relaxed) + 2;
+        version.store(updated - 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        bump(count, 1);
+        bump(sum, ticks);
+        bump(buckets[bucket(ticks)], 1);
+        bump(cpu, cpu_ns);
+        if (ticks < min.load(std::memory_order_relaxed)) {
+            min.store(ticks, std::memory_order_relaxed);
+        }
+        if (ticks > max.load(std::memory_order_relaxed)) {
+            max.store(ticks, std::memory_order_relaxed);
+        }
+        if (perf_deltas != nullptr) {
+            for (size_t counter = 0; counter < max_perf_counters; counter++) {
+                bump(perf[counter], perf_deltas[counter]);
+            }
+        }
+        version.store(updated, std::memory_order_release);
+    }
+
+    // Heap allocation, or free when `bytes` is negative.
+    void recordHeap(int64_t bytes) {
+        uint64_t updated = version.load(std::memory_order_relaxed) + 2;
+        version.store(updated - 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        bump(bytes >= 0 ? allocations : frees, 1);
+        bump(bytes >= 0 ? allocated_bytes : freed_bytes, static_cast<uint64_t>(bytes >= 0 ? bytes : -bytes));
+        version.store(updated, std::memory_order_release);
+    }
+};
+
+// Statistics of the zones ended by a thread, indexed by ZoneId.
+//
+// They are allocated the first time their zone ends and never move, behind
+// pages of pointers that are published with release semantics, so readers
+// only need acquire loads.
+struct ZoneStatsTable {
+    static constexpr size_t page_zones = 256;
+    static constexpr size_t max_pages = 1024;
+
+    struct Page {
+        std::atomic<ZoneStats *> zones[page_zones] = {};
+    };
+
+    std::atomic<Page *> pages[max_pages] = {};
+
+    ZoneStatsTable() = default;
+    ZoneStatsTable(const ZoneStatsTable &) = delete;
+    ZoneStatsTable &operator=(const ZoneStatsTable &) = delete;
+
+    ~ZoneStatsTable() {
+        for (auto &page : pages) {
+            if (Page *zones = page.load(std::memory_order_acquire)) {
+                for (auto &stats : zones->zones) {
+                    delete stats.load(std::memory_order_acquire);
+                }
+                delete zones;
+            }
+        }
+    }
+
+    // Statistics of `zone`, created if needed. Only called by the owner.
+    ZoneStats *get(ZoneId zone) {
+        if (zone >= page_zones * max_pages) {
+            return nullptr;
+        }
+        std::atomic<Page *> &page = pages[zone / page_zones];
+        Page *zones = page.load(std::memory_order_relaxed);
+        if (zones == nullptr) {
+            UntrackedAllocations untracked;
+            zones = new Page;
+            page.store(zones, std::memory_order_release);
+        }
+        std::atomic<ZoneStats *> &slot = zones->zones[zone % page_zones];
+        ZoneStats *stats = slot.load(std::memory_order_relaxed);
+        if (stats == nullptr) {
+            UntrackedAllocations untracked;
+            stats = new ZoneStats;
+            slot.store(stats, std::memory_order_release);
+        }
+        return stats;
+    }
+
+    // Calls `func(zone, stats)` for each zone with statistics.
+    template <typename Func>
+    void forEach(Func &&func) const {
+        for (size_t index = 0; index < max_pages; index++) {
+            if (Page *zones = pages[index].load(std::memory_order_acquire)) {
+                for (size_t slot = 0; slot < page_zones; slot++) {
+                    if (const ZoneStats *stats = zones->zones[slot].load(std::memory_order_acquire)) {
+                        func(static_cast<ZoneId>(index * page_zones + slot), *stats);
+                    }
+                }
+            }
+        }
+    }
+};
+
+// Call stack captured by the sampling timer.
+struct Sample {
+    ProfilerClock::rep time = 0;    // Sampling timestamp
+    uint32_t depth = 0;             // Frames captured
+    void *frames[max_sample_depth]; // Code addresses, the sampled one first
+};
+
+// Per-thread ring of stack samples.
+//
+// Samples are written by a signal handler interrupting the owner thread, so it
+// can neither allocate nor lock: they go into fixed slots, framed by sequence
+// numbers like a seqlock, then published by `head`. Readers, serialized by
+// `read_mtx`, consume them from `tail` and skip the slots rewritten while they
+// copied them. Once the ring is full, new samples are dropped, or overwrite
+// the oldest ones when `overwrite` is set.
+struct SampleBuffer {
+    struct Slot {
+        std::atomic<uint64_t> sequence = 0; // Index of the sample + 1, 0 while written
+        Sample sample;                      // Accessed through atomic_ref
+    };
+
+    std::unique_ptr<Slot[]> slots{new Slot[sample_buffer_size]};
+    bool overwrite = false;            // Overwrite the oldest samples when full
+    std::atomic<uint64_t> head = 0;    // Samples written
+    std::atomic<uint64_t> tail = 0;    // Samples consumed
+    std::atomic<uint64_t> dropped = 0; // Samples lost to a full ring
+
+    // Consumer side, guarded by `read_mtx`.
+    std::mutex read_mtx;
+    uint64_t overwritten = 0; // Samples rewritten before being consumed
+
+    // Owner stack, within which the signal handler follows frame pointers.
+    uintptr_t stack_low = 0;
+    uintptr_t stack_high = 0;
+
+#ifdef __linux__
+    timer_t timer{};        // Timer sending the samples signal
+    bool has_timer = false; // Whether `timer` was created
+
+    SampleBuffer() = default;
+    SampleBuffer(const SampleBuffer &) = delete;
+    SampleBuffer &operator=(const SampleBuffer &) = delete;
+
+    ~SampleBuffer() {
+        if (has_timer) {
+            timer_delete(timer);
+        }
+    }
+#endif
+
+    // Only called by the owner thread, from the signal handler.
+    void record(ProfilerClock::rep time, void *const *frames, uint32_t depth) {
+        uint64_t index = head.load(std::memory_order_relaxed);
+        if (!overwrite && index - tail.load(std::memory_order_acquire) >= sample_buffer_size) {
+            dropped.store(dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return;
+        }
+
+        Slot &slot = slots[index % sample_buffer_size];
+        slot.sequence.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        std::atomic_ref(slot.sample.time).store(time, std::memory_order_relaxed);
+        std::atomic_ref(slot.sample.depth).store(depth, std::memory_order_relaxed);
+        for (uint32_t frame = 0; frame < depth; frame++) {
+            std::atomic_ref(slot.sample.frames[frame]).store(frames[frame], std::memory_order_relaxed);
+        }
+        slot.sequence.store(index + 1, std::memory_order_release);
+        head.store(index + 1, std::memory_order_release);
+    }
+
+    // Calls `func` for each sample recorded since the previous drain, oldest
+    // first.
+    template <typename Func>
+    void drain(Func &&func) {
+        std::unique_lock<std::mutex> read_lk(read_mtx);
+        uint64_t skipped = 0;
+        tail.store(read(tail.load(std::memory_order_relaxed), func, skipped), std::memory_order_release);
+        overwritten += skipped;
+    }
+
+    // Calls `func` for each sample not drained yet, oldest first, leaving them
+    // in the buffer.
+    template <typename Func>
+    void forEach(Func &&func) {
+        std::unique_lock<std::mutex> read_lk(read_mtx);
+        uint64_t skipped = 0;
+        read(tail.load(std::memory_order_relaxed), func, skipped);
+    }
+
+private:
+    // Reads the samples from `begin` to `head`, counting the overwritten ones
+    // into `skipped`, and returns where it stopped.
+    template <typename Func>
+    uint64_t read(uint64_t begin, Func &func, uint64_t &skipped) {
+        uint64_t end = head.load(std::memory_order_acquire);
+        if (end - begin > sample_buffer_size) {
+            skipped += end - sample_buffer_size - begin;
+            begin = end - sample_buffer_size;
+        }
+
+        Sample sample;
+        for (uint64_t index = begin; index < end; index++) {
+            Slot &slot = slots[index % sample_buffer_size];
+            if (slot.sequence.load(std::memory_order_acquire) == index + 1) {
+                sample.time = std::atomic_ref(slot.sample.time).load(std::memory_order_relaxed);
+                sample.depth = std::min<uint32_t>(std::atomic_ref(slot.sample.depth).load(std::memory_order_relaxed), max_sample_depth);
+                for (uint32_t frame = 0; frame < sample.depth; frame++) {
+                    sample.frames[frame] = std::atomic_ref(slot.sample.frames[frame]).load(std::memory_order_relaxed);
+                }
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (slot.sequence.load(std::memory_order_relaxed) == index + 1) {
+                    func(sample);
+                    continue;
+                }
+            }
+            skipped++;
+        }
+        return end;
+    }
+};
+
+// Durations between frame marks. Marks are rare enough to be serialized by a
+// lock, so frames are recorded from any thread.
+struct FrameStats {
+    static constexpr size_t worst_count = 16;
+
+    struct Frame {
+        ProfilerClock::rep start; // Previous mark
+        uint64_t duration;        // Time until the mark ending the frame
+    };
+
+    std::mutex mtx;
+    uint64_t marks = 0;               // Frame marks so far
+    ProfilerClock::rep last_mark = 0; // Time of the latest mark
+    ZoneStats durations;              // Frame times histogram
+    std::vector<Frame> worst;         // Min-heap of the longest frames
+
+    void record(ProfilerClock::rep mark) {
+        std::unique_lock<std::mutex> frames_lk(mtx);
+        if (marks++ != 0) {
+            Frame frame{last_mark, static_cast<uint64_t>(std::max<ProfilerClock::rep>(mark - last_mark, 0))};
+            durations.record(frame.duration);
+            auto shorter = [](const Frame &a, const Frame &b) { return a.duration > b.duration; };
+            if (worst.size() < worst_count) {
+                worst.push_back(frame);
+                std::push_heap(worst.begin(), worst.end(), shorter);
+            } else if (frame.duration > worst.front().duration) {
+                std::pop_heap(worst.begin(), worst.end(), shorter);
+                worst.back() = frame;
+                std::push_heap(worst.begin(), worst.end(), shorter);
+            }
+        }
+        last_mark = mark;
+    }
+};
+
+// Perf events of a thread, opened as one group led by the task clock so that
+// a single read() returns every counter. Only the owner thread reads them.
+struct PerfCounters {
+    int fds[max_perf_counters];                          // Event of each counter, or -1
+    uint32_t opened = 0;                                 // Mask of the counters opened
+    uint64_t begins[max_stack_depth][max_perf_counters]; // Values when the active entries began
+
+    PerfCounters() { std::fill(std::begin(fds), std::end(fds), -1); }
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters &operator=(const PerfCounters &) = delete;
+
+    ~PerfCounters() {
+#ifdef __linux__
+        for (int fd : fds) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+#endif
+    }
+
+    // Current value of every counter, 0 for those not opened.
+    void read(uint64_t values[max_perf_counters]) const {
+        // Number of counters, then their values in the order they were opened.
+        uint64_t group[1 + max_perf_counters] = {};
+#ifdef __linux__
+        if (::read(fds[0], group, sizeof(group)) < static_cast<ssize_t>(sizeof(uint64_t))) {
+            group[0] = 0;
+        }
+#endif
+        size_t next = 1;
+        for (size_t counter = 0; counter < max_perf_counters; counter++) {
+            values[counter] = (opened >> counter & 1) && next <= group[0] ? group[next++] : 0;
+        }
+    }
+};
+
+// Records of the typed arguments or details of the active entries, stacked
+// as they begin. Only the owner thread writes them.
+struct ArgStack {
+    Entry records[max_arg_records];
+    uint32_t top = 0; // Records in use
 };
 
 // Profile entry that measure the time between two points in the program.
 struct ThreadProfiler {
-    std::string name = "";      // Timeline thread name
-    id::Thread::Tid tid = 0;    // Thread ID
-    int index = 0;              // Order in the thread list
-    std::stack<Entry> stack;    // Entries currently active
-    std::vector<Entry> entries; // Completed entries
+    std::string name = "";                     // Timeline thread name
+    id::Thread::Tid tid = 0;                   // Thread ID
+    int index = 0;                             // Order in the thread list
+    Entry stack[max_stack_depth];              // Entries currently active
+    std::atomic<uint64_t> stack_state = 0;     // See pushStackEntry()
+    EntryBuffer entries;                       // Completed entries
+    bool metadata_written = false;             // Thread metadata in the trace
+    ZoneStatsTable zone_stats;                 // Aggregated zone durations
+    std::unique_ptr<SampleBuffer> samples;     // Stack samples, if sampling
+    std::unique_ptr<PerfCounters> perf;        // Perf events, if counted
+    std::unique_ptr<int64_t[]> cpu_begins;     // CPU time when the active entries began
+    int64_t heap_recorded = 0;                 // Heap bytes last recorded in the timeline
+    std::unique_ptr<ArgStack> args;            // Typed arguments and details, once some are used
+};
+
+// Registry of every zone descriptor, indexed by ZoneId.
+struct ZoneRegistry {
+    std::mutex mtx;
+    std::vector<const ZoneDescriptor *> zones;
+    // Storage for zones registered with a runtime name. Keys are the interned
+    // names referenced by the descriptors, so the map must be node based.
+    std::unordered_map<std::string, ZoneId> interned_ids;
+    std::deque<ZoneDescriptor> interned_zones;
 };
 
 struct ProcessProfiler {
-    std::string name = "";                     // Timeline process name
-    id::Process::Pid pid = 0;                  // Process ID
-    int index = 0;                             // Order in the process list
-    std::string filename = "";                 // Name for the dumped trace file
-    bool enabled = false;                      // Enables the profiler.
-    std::list<ThreadProfiler> threads_profile; // Process threads profilers
+    std::string name = "";                       // Timeline process name
+    id::Process::Pid pid = 0;                    // Process ID
+    int index = 0;                               // Order in the process list
+    std::string filename = "";                   // Name for the dumped trace file
+    bool enabled = false;                        // Enables the profiler.
+    std::list<ThreadProfiler> threads_profile{}; // Process threads profilers
+    uint64_t buffer_chunks = 0;                  // Bound of each thread ring
+    chrono::nanoseconds flight_window{0};        // Dumped window, 0 keeps all
+    bool zone_stats = false;                     // Aggregate zone durations
+    bool timeline = true;                        // Record entries for the trace
+    unsigned dump_threads = 1;                   // Serialization workers
+    FrameStats frames{};                         // Frame times summary
+    chrono::microseconds sample_interval{0};     // Stack sampling period, 0 disables it
+    bool perf_counters = false;                  // Count perf events per zone
+    bool thread_cpu_time = false;                // Measure the CPU time of zones
+    bool track_allocations = false;              // Attribute heap allocations to zones
+    bool heap_counter = false;                   // Record the live heap bytes
+    std::atomic<int64_t> heap_bytes = 0;         // Live heap bytes, with heap_counter
+    ZoneId heap_counter_zone = 0;                // Name of the heap counter
+
+    // Trace file kept open by the background flusher.
+    std::unique_ptr<TraceWriter> writer{};
+    chrono::milliseconds flush_interval{0};
+    std::thread flusher{};
+    std::mutex flusher_mtx{};
+    std::condition_variable flusher_cv{};
+    bool flusher_stop = false;
+
+    // Snapshots taken while the application runs.
+    std::mutex snapshot_mtx{};
+    int snapshot_count = 0;
 };
 
 // Profiler global context.
@@ -108,125 +926,1467 @@ static std::mutex process_profiler_mtx;
 // Local profiler for each thread.
 static thread_local ThreadProfiler *thread_profiler;
 
-// Helpers functions.
-// =============================================================================
-static double toProfileScale(ProfilerClock::time_point tp) {
-    return chrono::duration_cast<ProfilerDuration>(tp.time_since_epoch()).count();
+// Profile points compiled in other translation units check the level before
+// any profiler function runs, so it is read at static initialization.
+static const bool profile_level_read = [] {
+    if (const char *env_str = std::getenv("GP_PROFILE_LEVEL"))
+        setProfileLevel(std::stoul(env_str, nullptr, 16));
+    return true;
+}();
+
+// Zones may be registered from static initializers, before any profiler
+// context exists.
+static ZoneRegistry &getZoneRegistry() {
+    static ZoneRegistry zone_registry;
+    return zone_registry;
 }
 
-static double toProfileScale(ProfilerClock::duration d) { return chrono::duration_cast<ProfilerDuration>(d).count(); }
+// Helpers functions.
+// =============================================================================
+static TscCalibration tsc_calibration;
 
-static std::string toLowerSnakeCase(const std::string &str) {
-    std::string res = str;
-    for (auto &c : res) {
-        if (c == ' ') {
-            c = '_';
-        } else {
-            c = std::tolower(c);
+// Samples the TSC and steady_clock as close together as possible.
+static void sampleTsc(ProfilerClock::rep &tsc, ProfilerClock::rep &ns) {
+#ifdef PROF_HAS_TSC
+    ProfilerClock::rep best_gap = std::numeric_limits<ProfilerClock::rep>::max();
+    for (int attempt = 0; attempt < 8; ++attempt) {
+        ProfilerClock::rep before = __rdtsc();
+        ProfilerClock::rep now = ProfilerClock::now().time_since_epoch().count();
+        ProfilerClock::rep after = __rdtsc();
+        if (after - before < best_gap) {
+            best_gap = after - before;
+            tsc = before + (after - before) / 2;
+            ns = now;
         }
     }
-    return res;
+#endif
 }
 
-// API functions.
-// =============================================================================
-void initProcessProfiler(std::string &&process_name, int index) {
-    std::unique_lock<std::mutex> process_lk(process_profiler_mtx);
-
-    // Strong check: immediately return if process profiler is already intialized.
-    if (process_profiler != nullptr) {
-        return;
+static bool hasInvariantTsc() {
+#if defined(_M_X64)
+    int regs[4];
+    __cpuid(regs, 0x80000000);
+    if (static_cast<unsigned>(regs[0]) < 0x80000007) {
+        return false;
     }
+    __cpuid(regs, 0x80000007);
+    return regs[3] & (1 << 8);
+#elif defined(__x86_64__)
+    unsigned eax, ebx, ecx, edx;
+    return __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) && (edx & (1 << 8));
+#else
+    return false;
+#endif
+}
 
-    if (process_name.empty()) {
-        process_name = default_process_name;
+static void enableTscClock() {
+    if (!hasInvariantTsc()) {
+        std::cerr << "Profiler: no invariant TSC, falling back to steady_clock\n";
+        return;
     }
 
-    // Create profile filename: filename_prefix + "_" + process_name + ".json"
-    std::string filename = "_";
-    if (const char *env_str = std::getenv("GP_FILENAME_PREFIX"))
-        filename = std::string(env_str) + "_" + toLowerSnakeCase(process_name) + ".json";
-
-    // Create a new process profiler.
-    process_profiler = new ProcessProfiler{
-        .name = std::move(process_name),
-        .pid = id::Process::getProcessId(),
-        .index = index,
-        .filename = filename,
-        .enabled = !filename.empty(),
-    };
+    sampleTsc(tsc_calibration.tsc_base, tsc_calibration.ns_base);
+    ProfilerClock::use_tsc.store(true, std::memory_order_relaxed);
 }
 
-void initThreadProfiler(std::string &&thread_name, int index) {
-    // Weak check: init process profiler if it is needed.
-    // Avoids double locking `process_profiler_mtx`.
-    if (process_profiler == nullptr) {
-        initProcessProfiler();
-    }
-
-    if (!process_profiler->enabled) {
+// Refines the TSC rate. It waits for a minimal span from the reference point
+// so that very short runs still get a sensible rate.
+static void calibrateTscClock() {
+    if (!ProfilerClock::use_tsc.load(std::memory_order_relaxed)) {
         return;
     }
 
-    std::unique_lock<std::mutex> process_lk(process_profiler_mtx);
+    constexpr ProfilerClock::rep min_span_ns = 10'000'000;
+    std::unique_lock<std::mutex> calibration_lk(tsc_calibration.mtx);
+    ProfilerClock::rep tsc = 0;
+    ProfilerClock::rep ns = 0;
+    do {
+        sampleTsc(tsc, ns);
+    } while (ns - tsc_calibration.ns_base < min_span_ns);
 
-    if (thread_profiler != nullptr) {
-        return;
+    double ns_per_cycle = double(ns - tsc_calibration.ns_base) / double(tsc - tsc_calibration.tsc_base);
+    tsc_calibration.ns_per_cycle.store(ns_per_cycle, std::memory_order_relaxed);
+}
+
+// Converts clock ticks into the steady_clock nanoseconds written in traces.
+static int64_t toProfileScale(ProfilerClock::rep ticks) {
+    if (!ProfilerClock::use_tsc.load(std::memory_order_relaxed)) {
+        return ticks;
     }
+    double ns_per_cycle = tsc_calibration.ns_per_cycle.load(std::memory_order_relaxed);
+    return tsc_calibration.ns_base + static_cast<int64_t>(double(ticks - tsc_calibration.tsc_base) * ns_per_cycle);
+}
 
-    if (thread_name.empty()) {
-        thread_name = default_thread_name;
+// Converts a duration into clock ticks.
+static ProfilerClock::rep toProfileTicks(chrono::nanoseconds duration) {
+    if (!ProfilerClock::use_tsc.load(std::memory_order_relaxed)) {
+        return duration.count();
     }
+    return static_cast<ProfilerClock::rep>(double(duration.count()) / tsc_calibration.ns_per_cycle.load(std::memory_order_relaxed));
+}
 
-    // Create new thread profiler and set thread local reference.
-    process_profiler->threads_profile.emplace_back(ThreadProfiler{
-        .name = std::move(thread_name),
-        .tid = id::Thread::getThreadId(),
-        .index = index,
-    });
-    thread_profiler = &process_profiler->threads_profile.back();
+// Converts a duration in clock ticks into nanoseconds.
+static double toProfileNanoseconds(double ticks) {
+    if (!ProfilerClock::use_tsc.load(std::memory_order_relaxed)) {
+        return ticks;
+    }
+    return ticks * tsc_calibration.ns_per_cycle.load(std::memory_order_relaxed);
 }
 
-void beginProfilePoint(const std::string &&name, const std::string &&details) {
-    assert(name != "");
+// Local copy of the zone registry. It is refreshed whenever an id registered
+// after the copy shows up. It also caches the names of the sampled code.
+struct ZoneNames {
+    std::vector<const ZoneDescriptor *> zones;
+    std::unordered_map<void *, std::string> symbols;
 
-    // Weak check: init thread profiler if it is needed.
-    // Avoids locking `process_prosfiler_mtx`.
-    if (thread_profiler == nullptr) {
-        initThreadProfiler();
+    const char *operator[](ZoneId zone) {
+        if (zone >= zones.size()) {
+            ZoneRegistry &registry = getZoneRegistry();
+            std::unique_lock<std::mutex> registry_lk(registry.mtx);
+            zones = registry.zones;
+        }
+        return zone < zones.size() ? zones[zone]->name : "";
     }
 
-    if (!process_profiler->enabled) {
-        return;
+    // Name of the function containing `address`, or its module and offset
+    // when the module does not export it.
+    std::string_view symbol(void *address) {
+        auto [symbol_it, inserted] = symbols.try_emplace(address);
+        if (!inserted) {
+            return symbol_it->second;
+        }
+
+        std::string &name = symbol_it->second;
+        char offset[32];
+        std::snprintf(offset, sizeof(offset), "%p", address);
+        name = offset;
+#ifdef __linux__
+        Dl_info info;
+        if (dladdr(address, &info) != 0) {
+            if (info.dli_sname != nullptr) {
+                int status = 0;
+                char *demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+                name = status == 0 ? demangled : info.dli_sname;
+                std::free(demangled);
+            } else if (info.dli_fname != nullptr) {
+                std::string_view module = info.dli_fname;
+                module.remove_prefix(module.find_last_of('/') + 1);
+                size_t module_offset = static_cast<char *>(address) - static_cast<char *>(info.dli_fbase);
+                std::snprintf(offset, sizeof(offset), "+0x%zx", module_offset);
+                name = std::string(module) + offset;
+            }
+        }
+#endif
+        return name;
     }
+};
 
-    // Add new entry to local profiler stack.
-    thread_profiler->stack.emplace(Entry{
-        .name = std::move(name),
-        .details = std::move(details),
-        .start = ProfilerClock::now(),
-    });
+static std::string toLowerSnakeCase(const std::string &str) {
+    std::string res = str;
+    for (auto &c : res) {
+        if (c == ' ') {
+            c = '_';
+        } else {
+            c = std::tolower(c);
+        }
+    }
+    return res;
 }
 
-void endProfilePoint() {
-    assert(process_profiler != nullptr);
-
-    if (!process_profiler->enabled) {
-        return;
+// Position of the extensions of a trace filename, format and compression.
+static size_t extensionPosition(const std::string &filename) {
+    size_t format_end = withoutCompressionExtension(filename).size();
+    size_t extension = filename.rfind('.', format_end - 1);
+    if (extension == std::string::npos || filename.find_first_of("/\\", extension) < format_end) {
+        return format_end;
     }
+    return extension;
+}
 
-    assert(thread_profiler != nullptr);
-    assert(!thread_profiler->stack.empty());
+static std::vector<ThreadProfiler *> listThreadProfilers() {
+    std::unique_lock<std::mutex> process_lk(process_profiler_mtx);
 
-    // Finish top stack entry and move it to the entries list.
-    Entry &entry = thread_profiler->stack.top();
-    entry.end = ProfilerClock::now();
-    thread_profiler->entries.emplace_back(entry);
-    thread_profiler->stack.pop();
+    std::vector<ThreadProfiler *> threads;
+    for (auto &tprof : process_profiler->threads_profile) {
+        threads.push_back(&tprof);
+    }
+    return threads;
 }
 
-void dumpTracingFile() {
-    assert(process_profiler != nullptr);
+// The stack state packs the nesting of active entries in its low 32 bits and
+// the number of entries ever begun in its high 32 bits. It is only written by
+// the owner thread, so readers can tell whether a slot they copied was reused
+// in the meantime.
+//
+// Slots are accessed field by field through relaxed atomic references, which
+// compile to plain moves, since snapshots may read them concurrently.
+static void pushStackEntry(ThreadProfiler &tprof, const Entry &entry) {
+    uint64_t state = tprof.stack_state.load(std::memory_order_relaxed);
+    uint32_t depth = static_cast<uint32_t>(state);
+
+    // Entries nested too deep are only counted, so that their end still pops
+    // the right entry. The CPU time is read right after the start, on the
+    // same side of the perf counter reads, so that they count as on CPU.
+    if (depth < max_stack_depth) {
+        if (tprof.cpu_begins != nullptr) {
+            tprof.cpu_begins[depth] = ThreadCpuClock::nanoseconds();
+        }
+        Entry &slot = tprof.stack[depth];
+        std::atomic_ref(slot.start).store(entry.start, std::memory_order_relaxed);
+        std::atomic_ref(slot.zone).store(entry.zone, std::memory_order_relaxed);
+        std::atomic_ref(slot.details).store(entry.details, std::memory_order_relaxed);
+        if (tprof.perf != nullptr) {
+            tprof.perf->read(tprof.perf->begins[depth]);
+        }
+    }
+    tprof.stack_state.store(state + (uint64_t(1) << 32) + 1, std::memory_order_release);
+}
+
+static Entry loadStackEntry(ThreadProfiler &tprof, uint32_t depth) {
+    Entry &slot = tprof.stack[depth];
+    return Entry{
+        .start = std::atomic_ref(slot.start).load(std::memory_order_relaxed),
+        .zone = std::atomic_ref(slot.zone).load(std::memory_order_relaxed),
+        .details = std::atomic_ref(slot.details).load(std::memory_order_relaxed),
+    };
+}
+
+static uint32_t stackDepth(const ThreadProfiler &tprof) {
+    return static_cast<uint32_t>(tprof.stack_state.load(std::memory_order_relaxed));
+}
+
+// Argument records are accessed like the stack slots, as snapshots may copy
+// those of the active entries.
+static void storeArgRecord(Entry &slot, const Entry &record) {
+    std::atomic_ref(slot.start).store(record.start, std::memory_order_relaxed);
+    std::atomic_ref(slot.end).store(record.end, std::memory_order_relaxed);
+    std::atomic_ref(slot.zone).store(record.zone, std::memory_order_relaxed);
+    std::atomic_ref(slot.details).store(record.details, std::memory_order_relaxed);
+}
+
+static Entry loadArgRecord(Entry &slot) {
+    return Entry{
+        .start = std::atomic_ref(slot.start).load(std::memory_order_relaxed),
+        .end = std::atomic_ref(slot.end).load(std::memory_order_relaxed),
+        .zone = std::atomic_ref(slot.zone).load(std::memory_order_relaxed),
+        .details = std::atomic_ref(slot.details).load(std::memory_order_relaxed),
+    };
+}
+
+// Copies the active entries of a thread from any other thread, and the
+// records of their arguments into `args`, in the same order. Gives up after
+// a few attempts if the owner keeps beginning new entries.
+static std::vector<Entry> copyStackEntries(ThreadProfiler &tprof, std::vector<Entry> &args) {
+    std::vector<Entry> entries;
+    for (int attempt = 0; attempt < 8; ++attempt) {
+        uint64_t state = tprof.stack_state.load(std::memory_order_acquire);
+        uint32_t depth = std::min<uint32_t>(static_cast<uint32_t>(state), max_stack_depth);
+        entries.clear();
+        for (uint32_t i = 0; i < depth; ++i) {
+            entries.push_back(loadStackEntry(tprof, i));
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t new_state = tprof.stack_state.load(std::memory_order_relaxed);
+        if ((state >> 32) != (new_state >> 32)) {
+            continue;
+        }
+        // Entries ended meanwhile are still in the buffer, skip them.
+        entries.resize(std::min<uint32_t>(depth, static_cast<uint32_t>(new_state)));
+
+        // The records of the copied entries were stacked before they began,
+        // in order. The owner rewrites those above the active entries before
+        // beginning a new one, so they are only trusted if no entry ended nor
+        // began while they were copied.
+        args.clear();
+        uint32_t records = 0;
+        for (const Entry &entry : entries) {
+            records += entry.details;
+        }
+        for (uint32_t record = 0; record < records; record++) {
+            args.push_back(loadArgRecord(tprof.args->records[record]));
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (tprof.stack_state.load(std::memory_order_relaxed) == new_state) {
+            return entries;
+        }
+    }
+    entries.clear();
+    args.clear();
+    return entries;
+}
+
+// First bytes of `text`, truncated to `max_bytes` on a whole UTF-8 character.
+static std::string_view truncateText(std::string_view text, size_t max_bytes) {
+    size_t length = std::min(text.size(), max_bytes);
+    while (length < text.size() && length > 0 && (static_cast<unsigned char>(text[length]) & 0xc0) == 0x80) {
+        length--;
+    }
+    return text.substr(0, length);
+}
+
+static ArgStack &argStack(ThreadProfiler &tprof) {
+    if (tprof.args == nullptr) {
+        UntrackedAllocations untracked;
+        tprof.args = std::make_unique<ArgStack>();
+    }
+    return *tprof.args;
+}
+
+// Encodes `args` as records on the argument stack of the thread, keys and
+// strings over as many arg_text records as they need. Arguments that do not
+// fit are left out.
+//
+// \returns the number of records, the `details` of the entry they belong to.
+static uint32_t stackArgs(ThreadProfiler &tprof, const ZoneArg *args, size_t count) {
+    ArgStack &stack = argStack(tprof);
+    uint32_t begin = stack.top;
+    for (const ZoneArg &arg : std::span(args, std::min(count, max_zone_args))) {
+        std::string_view key = truncateText(arg.key, max_arg_key);
+        std::string_view text = arg.type == ArgType::string ? truncateText(arg.text, max_arg_string) : std::string_view();
+        size_t length = key.size() + text.size();
+        size_t records = 1 + (std::max(length, arg_first_bytes) - arg_first_bytes + arg_text_bytes - 1) / arg_text_bytes;
+        if (stack.top + records > max_arg_records) {
+            break;
+        }
+
+        char bytes[arg_first_bytes + max_arg_key + max_arg_string] = {};
+        key.copy(bytes, key.size());
+        text.copy(bytes + key.size(), text.size());
+
+        ProfilerClock::rep value = static_cast<ProfilerClock::rep>(arg.type == ArgType::string ? text.size() : arg.bits);
+        Entry record = Entry::make(EntryKind::arg, 0, 0, value);
+        record.details = static_cast<uint32_t>(arg.type) | static_cast<uint32_t>(key.size()) << arg_key_shift;
+        std::memcpy(&record.start, bytes, sizeof(record.start));
+        storeArgRecord(stack.records[stack.top++], record);
+        for (size_t offset = arg_first_bytes; offset < length; offset += arg_text_bytes) {
+            Entry next = Entry::make(EntryKind::arg_text, 0, 0, 0);
+            std::memcpy(&next.start, bytes + offset, sizeof(next.start));
+            std::memcpy(&next.end, bytes + offset + sizeof(next.start), sizeof(next.end));
+            std::memcpy(&next.details, bytes + offset + sizeof(next.start) + sizeof(next.end), sizeof(next.details));
+            storeArgRecord(stack.records[stack.top++], next);
+        }
+    }
+    return stack.top - begin;
+}
+
+// Encodes `details` as records on the argument stack of the thread, like a
+// string argument. Details over max_details are truncated, and left out if
+// they do not fit.
+//
+// \returns the number of records, the `details` of the entry they belong to.
+static uint32_t stackDetails(ThreadProfiler &tprof, std::string_view details) {
+    ArgStack &stack = argStack(tprof);
+    std::string_view text = truncateText(details, max_details);
+    size_t records = 1 + (std::max(text.size(), arg_first_bytes) - arg_first_bytes + arg_text_bytes - 1) / arg_text_bytes;
+    if (stack.top + records > max_arg_records) {
+        return 0;
+    }
+
+    uint32_t begin = stack.top;
+    Entry record = Entry::make(EntryKind::details, 0, 0, static_cast<ProfilerClock::rep>(text.size()));
+    text.copy(reinterpret_cast<char *>(&record.start), std::min(text.size(), arg_first_bytes));
+    storeArgRecord(stack.records[stack.top++], record);
+    for (size_t offset = arg_first_bytes; offset < text.size(); offset += arg_text_bytes) {
+        char bytes[arg_text_bytes] = {};
+        text.copy(bytes, arg_text_bytes, offset);
+        Entry next = Entry::make(EntryKind::arg_text, 0, 0, 0);
+        std::memcpy(&next.start, bytes, sizeof(next.start));
+        std::memcpy(&next.end, bytes + sizeof(next.start), sizeof(next.end));
+        std::memcpy(&next.details, bytes + sizeof(next.start) + sizeof(next.end), sizeof(next.details));
+        storeArgRecord(stack.records[stack.top++], next);
+    }
+    return stack.top - begin;
+}
+
+// Appends `str` to `out` as a JSON string.
+static void appendJsonString(std::string &out, std::string_view str) {
+    static constexpr char hex_digits[] = "0123456789abcdef";
+    out += '"';
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            out += "\\u00";
+            out += hex_digits[c >> 4];
+            out += hex_digits[c & 0xf];
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+// Appends the details of a profile point to `out` as a JSON object, without
+// its closing brace. Details are meant to hold a JSON object, and other text
+// is kept as the string of a "details" member.
+static void appendDetails(std::string &out, std::string_view details) {
+    size_t first = details.find_first_not_of(" \t\r\n");
+    if (first != std::string_view::npos && details[first] == '{' && nlohmann::json::accept(details.begin(), details.end())) {
+        std::string_view members = details.substr(0, details.rfind('}'));
+        out.append(members.substr(0, members.find_last_not_of(" \t\r\n") + 1));
+    } else {
+        out += "{\"details\":";
+        appendJsonString(out, details);
+    }
+}
+
+// Formats the arg, details and arg_text records of a profile point into a
+// JSON object, without its closing brace.
+struct ArgsFormatter {
+    std::string args = ""; // Formatted arguments
+    Entry arg = {};        // Record of the argument or details being read
+    std::string text = ""; // Key then string value of `arg`, or details
+    size_t text_left = 0;  // Bytes of `text` still to come
+
+    void operator()(const Entry &record) {
+        if (record.kind() == EntryKind::arg) {
+            auto type = static_cast<ArgType>(record.details & ((1u << arg_key_shift) - 1));
+            arg = record;
+            text_left = (record.details >> arg_key_shift) + (type == ArgType::string ? static_cast<size_t>(record.end) : 0);
+            text.clear();
+            addBytes(record, arg_first_bytes);
+        } else if (record.kind() == EntryKind::details) {
+            arg = record;
+            text_left = static_cast<size_t>(record.end);
+            text.clear();
+            addBytes(record, arg_first_bytes);
+        } else if (record.kind() == EntryKind::arg_text && text_left > 0) {
+            addBytes(record, arg_text_bytes);
+        }
+    }
+
+    bool empty() const { return args.empty(); }
+    void clear() { args.clear(); }
+
+private:
+    void addBytes(const Entry &record, size_t size) {
+        char bytes[arg_text_bytes];
+        std::memcpy(bytes, &record.start, sizeof(record.start));
+        std::memcpy(bytes + sizeof(record.start), &record.end, sizeof(record.end));
+        std::memcpy(bytes + sizeof(record.start) + sizeof(record.end), &record.details, sizeof(record.details));
+        size_t length = std::min(text_left, size);
+        text.append(bytes, length);
+        text_left -= length;
+        if (text_left > 0) {
+            return;
+        }
+        if (arg.kind() == EntryKind::details) {
+            appendDetails(args, text);
+        } else {
+            addArg();
+        }
+    }
+
+    void addArg() {
+        size_t key_length = arg.details >> arg_key_shift;
+        args += args.empty() ? "{" : ",";
+        appendJsonString(args, std::string_view(text).substr(0, key_length));
+        args += ':';
+
+        char digits[32];
+        std::to_chars_result result{digits, std::errc()};
+        switch (static_cast<ArgType>(arg.details & ((1u << arg_key_shift) - 1))) {
+        case ArgType::int64:
+            result = std::to_chars(digits, digits + sizeof(digits), static_cast<int64_t>(arg.end));
+            break;
+        case ArgType::uint64:
+            result = std::to_chars(digits, digits + sizeof(digits), static_cast<uint64_t>(arg.end));
+            break;
+        case ArgType::float64:
+            if (double value = std::bit_cast<double>(arg.end); std::isfinite(value)) {
+                result = std::to_chars(digits, digits + sizeof(digits), value);
+            } else {
+                args += "null";
+            }
+            break;
+        case ArgType::boolean:
+            args += arg.end != 0 ? "true" : "false";
+            break;
+        case ArgType::string:
+            appendJsonString(args, std::string_view(text).substr(std::min(key_length, text.size())));
+            break;
+        default:
+            // Unknown type, the args stay valid JSON.
+            args += "null";
+            break;
+        }
+        args.append(digits, result.ptr);
+    }
+};
+
+// Writes the entries of a thread in order, skipping those completed before
+// `since`. Details, typed args, perf deltas and CPU times come right before
+// their profile point, in the same chunk, and are added to its args.
+struct EntryWriter {
+    TraceWriter &writer;
+    ThreadProfiler &tprof;
+    ZoneNames &zones;
+    ProfilerClock::rep since = 0;
+    uint64_t perf_deltas[max_perf_counters] = {};
+    int64_t cpu_time = 0;          // Of the next profile point, in nanoseconds
+    ArgsFormatter next_args = {};  // Of the next profile point
+    std::string args = "";         // Args of the latest profile point with measurements
+
+    void operator()(const Entry &entry) {
+        if (entry.kind() == EntryKind::arg || entry.kind() == EntryKind::arg_text || entry.kind() == EntryKind::details) {
+            next_args(entry);
+            return;
+        }
+        if (entry.kind() == EntryKind::perf) {
+            size_t counter = 2 * size_t(entry.details);
+            perf_deltas[counter] = static_cast<uint64_t>(entry.start);
+            if (counter + 1 < max_perf_counters) {
+                perf_deltas[counter + 1] = static_cast<uint64_t>(entry.end);
+            }
+            return;
+        }
+        if (entry.kind() == EntryKind::cpu_time) {
+            cpu_time = entry.start;
+            return;
+        }
+        if (entry.time() < since) {
+            next_args.clear();
+            return;
+        }
+
+        uint32_t pid = process_profiler->pid;
+        int64_t tid = static_cast<int64_t>(tprof.tid);
+        int64_t start = toProfileScale(entry.start);
+        const char *name = zones[entry.zoneId()];
+        switch (entry.kind()) {
+        case EntryKind::zone:
+            writer.completeEvent(name, pid, tid, start, toProfileScale(entry.end) - start, zoneArgs(entry));
+            break;
+        case EntryKind::counter:
+            writer.counterEvent(name, pid, tid, start, std::bit_cast<double>(entry.end));
+            break;
+        case EntryKind::instant:
+            writer.instantEvent(name, pid, tid, start, static_cast<char>(entry.details));
+            break;
+        case EntryKind::flow:
+            writer.flowEvent(name, pid, tid, start, static_cast<char>(entry.details), static_cast<uint64_t>(entry.end));
+            break;
+        case EntryKind::async_begin:
+        case EntryKind::async_end:
+            writer.asyncEvent(name, zones[entry.details], pid, tid, start, entry.kind() == EntryKind::async_begin ? 'b' : 'e',
+                              static_cast<uint64_t>(entry.end));
+            break;
+        case EntryKind::perf:
+        case EntryKind::cpu_time:
+        case EntryKind::arg:
+        case EntryKind::arg_text:
+        case EntryKind::details:
+            break;
+        }
+        next_args.clear();
+    }
+
+    // Details or typed args of a profile point, with the measurements of the
+    // thread.
+    std::string_view zoneArgs(const Entry &entry) {
+        if (!next_args.empty()) {
+            args.swap(next_args.args);
+        } else if (tprof.perf == nullptr && tprof.cpu_begins == nullptr) {
+            return "{}";
+        } else {
+            args = "{";
+        }
+        auto add = [this](const char *key, int64_t value) {
+            args += args.size() > 1 ? ",\"" : "\"";
+            args += key;
+            args += "\":";
+            args += std::to_string(value);
+        };
+        if (tprof.cpu_begins != nullptr) {
+            int64_t wall = toProfileScale(entry.end) - toProfileScale(entry.start);
+            add("cpu_time_ns", cpu_time);
+            add("off_cpu_ns", std::max<int64_t>(wall - cpu_time, 0));
+        }
+        for (size_t counter = 0; counter < max_perf_counters; counter++) {
+            if (tprof.perf != nullptr && (tprof.perf->opened >> counter & 1)) {
+                add(perf_counter_names[counter], static_cast<int64_t>(perf_deltas[counter]));
+            }
+        }
+        args += '}';
+        return args;
+    }
+};
+
+// Writes the stack samples of a thread taken since `since`, consuming them
+// unless it is a snapshot.
+static void writeSamples(TraceWriter &writer, ThreadProfiler &tprof, ZoneNames &zones, ProfilerClock::rep since, bool consume) {
+    if (tprof.samples == nullptr) {
+        return;
+    }
+
+    std::vector<std::string_view> frames;
+    auto write_sample = [&](const Sample &sample) {
+        if (sample.time < since) {
+            return;
+        }
+        // Callers are resolved from their return address minus one, which is
+        // still in their call instruction.
+        frames.clear();
+        for (uint32_t frame = sample.depth; frame-- > 0;) {
+            frames.push_back(zones.symbol(static_cast<char *>(sample.frames[frame]) - (frame > 0 ? 1 : 0)));
+        }
+        writer.sampleEvent(process_profiler->pid, static_cast<int64_t>(tprof.tid), toProfileScale(sample.time), frames);
+    };
+    if (consume) {
+        tprof.samples->drain(write_sample);
+    } else {
+        tprof.samples->forEach(write_sample);
+    }
+}
+
+// The trace format is chosen by the extension of the file, before the
+// compression one.
+static std::unique_ptr<TraceWriter> openTraceWriter(const std::string &filename) {
+    std::unique_ptr<TraceWriter> writer;
+    std::string_view format = withoutCompressionExtension(filename);
+    if (format.ends_with(binary_trace_extension)) {
+        writer = std::make_unique<BinaryTraceWriter>(filename);
+    } else if (format.ends_with(perfetto_trace_extension)) {
+        writer = std::make_unique<PerfettoTraceWriter>(filename);
+    } else {
+        writer = std::make_unique<ChromeTraceWriter>(filename);
+    }
+    if (!writer->isOpen()) {
+        std::cerr << "Profiler: could not open " << filename << '\n';
+        return nullptr;
+    }
+
+    // Naming and ordering of the process.
+    writer->processMetadata(process_profiler->pid, process_profiler->name, process_profiler->index);
+    return writer;
+}
+
+// Fragments of the threads being serialized, handed by the workers to the
+// thread appending them in order. Only that thread uses the writer, so it
+// also creates the fragments the workers ask for.
+//
+// A worker waits once its thread has `max_pending` fragments left to append,
+// so each worker holds a bounded number of fragments however long its thread
+// is, and the appending thread always has a fragment to make progress with.
+class FragmentQueue {
+public:
+    static constexpr size_t max_pending = 2;
+
+    explicit FragmentQueue(size_t threads) : pending(threads) {}
+
+    // Blank fragment to write into, waiting for the appending thread.
+    std::unique_ptr<TraceWriter> take() {
+        std::unique_lock<std::mutex> queue_lk(mtx);
+        requested++;
+        cv.notify_all();
+        cv.wait(queue_lk, [&] { return !blank.empty(); });
+        std::unique_ptr<TraceWriter> fragment = std::move(blank.back());
+        blank.pop_back();
+        return fragment;
+    }
+
+    // Queues the written `fragment` of thread `index`, the last one when
+    // `complete`, and waits until it is not too far ahead of the appending.
+    void handOff(size_t index, std::unique_ptr<TraceWriter> fragment, bool complete) {
+        std::unique_lock<std::mutex> queue_lk(mtx);
+        Pending &thread = pending[index];
+        thread.fragments.push_back(std::move(fragment));
+        thread.complete = complete;
+        cv.notify_all();
+        cv.wait(queue_lk, [&] { return complete || thread.fragments.size() < max_pending; });
+    }
+
+    // Appends the fragments of every thread to `writer` as they get written,
+    // in order, creating the blank fragments meanwhile.
+    void appendAll(TraceWriter &writer) {
+        std::unique_lock<std::mutex> queue_lk(mtx);
+        for (Pending &thread : pending) {
+            while (true) {
+                cv.wait(queue_lk, [&] { return requested > 0 || !thread.fragments.empty() || thread.complete; });
+                for (; requested > 0; requested--) {
+                    blank.push_back(writer.fragment());
+                }
+                if (thread.fragments.empty()) {
+                    cv.notify_all();
+                    if (thread.complete) {
+                        break;
+                    }
+                    continue;
+                }
+
+                std::unique_ptr<TraceWriter> fragment = std::move(thread.fragments.front());
+                thread.fragments.pop_front();
+                cv.notify_all();
+                queue_lk.unlock();
+                writer.append(*fragment);
+                fragment.reset();
+                queue_lk.lock();
+            }
+        }
+    }
+
+private:
+    struct Pending {
+        std::deque<std::unique_ptr<TraceWriter>> fragments; // Written, not appended yet
+        bool complete = false;                              // Whether the thread is fully written
+    };
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::vector<Pending> pending;                    // Per thread, in order
+    std::vector<std::unique_ptr<TraceWriter>> blank; // Fragments created for the workers
+    size_t requested = 0;                            // Fragments asked for by the workers
+};
+
+// Writer of the events of one thread into fragments handed to the queue as
+// they fill up. Events are whole, so a fragment never splits a profile point
+// from its args.
+//
+// Past `min_fragment_events`, a fragment is handed over once each flow step
+// written to it lies within a profile point written to it too: profile points
+// are written as they end, so the later ones only enclose these steps from
+// outside and the steps keep their innermost slice. A fragment is cut anyway
+// at `max_fragment_events`, for flow steps outside of any profile point.
+class FragmentWriter final : public TraceWriter {
+public:
+    static constexpr size_t min_fragment_events = 4096;
+    static constexpr size_t max_fragment_events = 16 * min_fragment_events;
+
+    FragmentWriter(FragmentQueue &queue, size_t index) : queue(queue), index(index), current(queue.take()) {}
+
+    // Hands the last fragment to the queue.
+    void finish() { queue.handOff(index, std::move(current), true); }
+
+    bool isOpen() const override { return true; }
+
+    void completeEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t start_ns, int64_t duration_ns,
+                       std::string_view args) override {
+        next();
+        current->completeEvent(name, pid, tid, start_ns, duration_ns, args);
+        if (start_ns <= unenclosed_ns) {
+            unenclosed_ns = std::numeric_limits<int64_t>::max();
+        }
+    }
+
+    void unfinishedEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t start_ns, std::string_view args) override {
+        next();
+        current->unfinishedEvent(name, pid, tid, start_ns, args);
+    }
+
+    void counterEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t time_ns, double value) override {
+        next();
+        current->counterEvent(name, pid, tid, time_ns, value);
+    }
+
+    void instantEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t time_ns, char scope) override {
+        next();
+        current->instantEvent(name, pid, tid, time_ns, scope);
+    }
+
+    void flowEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t time_ns, char phase, uint64_t id) override {
+        next();
+        current->flowEvent(name, pid, tid, time_ns, phase, id);
+        unenclosed_ns = std::min(unenclosed_ns, time_ns);
+    }
+
+    void asyncEvent(std::string_view name, std::string_view category, uint32_t pid, int64_t tid, int64_t time_ns, char phase,
+                    uint64_t id) override {
+        next();
+        current->asyncEvent(name, category, pid, tid, time_ns, phase, id);
+    }
+
+    void sampleEvent(uint32_t pid, int64_t tid, int64_t time_ns, const std::vector<std::string_view> &frames) override {
+        next();
+        current->sampleEvent(pid, tid, time_ns, frames);
+    }
+
+    void processMetadata(uint32_t pid, std::string_view name, int sort_index) override { current->processMetadata(pid, name, sort_index); }
+
+    void threadMetadata(uint32_t pid, int64_t tid, std::string_view name, int sort_index) override {
+        current->threadMetadata(pid, tid, name, sort_index);
+    }
+
+    void flush() override {}
+
+    // Fragments are created and appended by the queue only.
+    std::unique_ptr<TraceWriter> fragment() override { return nullptr; }
+    void append(TraceWriter &) override {}
+
+private:
+    // Hands `current` over once full, before the next event.
+    void next() {
+        bool enclosed = unenclosed_ns == std::numeric_limits<int64_t>::max();
+        if ((events >= min_fragment_events && enclosed) || events == max_fragment_events) {
+            queue.handOff(index, std::move(current), false);
+            current = queue.take();
+            events = 0;
+            unenclosed_ns = std::numeric_limits<int64_t>::max();
+        }
+        events++;
+    }
+
+    FragmentQueue &queue;
+    size_t index;                                                // Thread written
+    std::unique_ptr<TraceWriter> current;                        // Fragment being filled
+    size_t events = 0;                                           // Events written to `current`
+    int64_t unenclosed_ns = std::numeric_limits<int64_t>::max(); // Earliest flow step of `current` out of its profile points
+};
+
+// Writes every thread with `write_thread(writer, tprof, zones)`, in order.
+//
+// With several dump threads, workers serialize the threads concurrently into
+// size-capped fragments that this thread appends in order as soon as they are
+// complete, so the memory held stays bounded by the number of workers rather
+// than by the length of the threads.
+template <typename WriteThread>
+static void serializeThreads(TraceWriter &writer, const std::vector<ThreadProfiler *> &threads, WriteThread write_thread) {
+    size_t workers = std::min<size_t>(process_profiler->dump_threads, threads.size());
+    if (workers <= 1) {
+        ZoneNames zones;
+        for (ThreadProfiler *tprof : threads) {
+            write_thread(writer, *tprof, zones);
+        }
+        return;
+    }
+
+    FragmentQueue queue(threads.size());
+    std::atomic<size_t> assigned = 0; // Threads taken by a worker
+
+    auto run_worker = [&] {
+        // The fragments are freed by this thread, so their allocations must
+        // not be counted either.
+        UntrackedAllocations untracked;
+        ZoneNames zones;
+        for (size_t index = assigned++; index < threads.size(); index = assigned++) {
+            FragmentWriter out(queue, index);
+            write_thread(out, *threads[index], zones);
+            out.finish();
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (size_t i = 0; i < workers; i++) {
+        pool.emplace_back(run_worker);
+    }
+
+    queue.appendAll(writer);
+    for (std::thread &worker : pool) {
+        worker.join();
+    }
+}
+
+// Writes the entries completed since the previous drain of every thread,
+// skipping those that ended before `since`. Only the flusher or, once it is
+// stopped, dumpTracingFile() may call it. Details travel in the entry ring
+// with their profile point, so the instrumented threads never wait for it.
+static void drainThreadProfilers(TraceWriter &writer, ProfilerClock::rep since = 0) {
+    std::vector<ThreadProfiler *> threads = listThreadProfilers();
+    calibrateTscClock();
+
+    serializeThreads(writer, threads, [since](TraceWriter &out, ThreadProfiler &tprof, ZoneNames &zones) {
+        // Naming and ordering of the thread.
+        if (!tprof.metadata_written) {
+            out.threadMetadata(process_profiler->pid, static_cast<int64_t>(tprof.tid), tprof.name, tprof.index);
+            tprof.metadata_written = true;
+        }
+
+        tprof.entries.drain(EntryWriter{out, tprof, zones, since});
+        writeSamples(out, tprof, zones, since, true);
+    });
+}
+
+// The flight recorder dumps the same time window for every thread: the
+// requested last seconds, cut after the newest entry any thread lost.
+static ProfilerClock::rep flightWindowStart(const std::vector<ThreadProfiler *> &threads) {
+    if (process_profiler->flight_window.count() == 0) {
+        return 0;
+    }
+
+    calibrateTscClock();
+    ProfilerClock::rep since = ProfilerClock::ticks() - toProfileTicks(process_profiler->flight_window);
+    for (ThreadProfiler *tprof : threads) {
+        std::unique_lock<std::mutex> read_lk(tprof->entries.read_mtx);
+        if (tprof->entries.overwritten > 0) {
+            since = std::max(since, tprof->entries.evicted_end);
+        }
+    }
+    return since;
+}
+
+// Writes the entries still held by every thread, without draining them, and
+// the active entries as unfinished ones.
+static void writeSnapshot(TraceWriter &writer) {
+    std::vector<ThreadProfiler *> threads = listThreadProfilers();
+    ProfilerClock::rep since = flightWindowStart(threads);
+
+    serializeThreads(writer, threads, [since](TraceWriter &out, ThreadProfiler &tprof, ZoneNames &zones) {
+        out.threadMetadata(process_profiler->pid, static_cast<int64_t>(tprof.tid), tprof.name, tprof.index);
+
+        tprof.entries.forEach(EntryWriter{out, tprof, zones, since});
+        writeSamples(out, tprof, zones, since, false);
+
+        std::vector<Entry> arg_records;
+        std::vector<Entry> active = copyStackEntries(tprof, arg_records);
+        const Entry *record = arg_records.data();
+        ArgsFormatter args;
+        for (const Entry &entry : active) {
+            args.clear();
+            std::for_each(record, record + entry.details, std::ref(args));
+            record += entry.details;
+            args.args += args.empty() ? "{}" : "}";
+            out.unfinishedEvent(zones[entry.zone], process_profiler->pid, static_cast<int64_t>(tprof.tid), toProfileScale(entry.start),
+                                args.args);
+        }
+    });
+}
+
+// Statistics of a zone merged across threads, in clock ticks.
+struct ZoneSummary {
+    // Copies of a zone updated meanwhile are retried this many times at most,
+    // after which the last one is kept, off by the records in progress.
+    static constexpr int max_copy_attempts = 16;
+
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t min = std::numeric_limits<uint64_t>::max();
+    uint64_t max = 0;
+    std::vector<uint64_t> buckets = std::vector<uint64_t>(ZoneStats::buckets_count);
+    uint64_t perf[max_perf_counters] = {};
+    uint64_t cpu = 0;
+    uint64_t allocations = 0, allocated_bytes = 0, frees = 0, freed_bytes = 0;
+
+    void merge(const ZoneStats &stats) {
+        uint64_t copy_count, copy_sum, copy_min, copy_max, copy_cpu;
+        uint64_t copy_allocations, copy_allocated_bytes, copy_frees, copy_freed_bytes;
+        uint64_t copy_buckets[ZoneStats::buckets_count];
+        uint64_t copy_perf[max_perf_counters];
+        for (int attempt = 0; attempt < max_copy_attempts; attempt++) {
+            uint64_t version = stats.version.load(std::memory_order_acquire);
+            copy_count = stats.count.load(std::memory_order_relaxed);
+            copy_sum = stats.sum.load(std::memory_order_relaxed);
+            copy_min = stats.min.load(std::memory_order_relaxed);
+            copy_max = stats.max.load(std::memory_order_relaxed);
+            copy_cpu = stats.cpu.load(std::memory_order_relaxed);
+            copy_allocations = stats.allocations.load(std::memory_order_relaxed);
+            copy_allocated_bytes = stats.allocated_bytes.load(std::memory_order_relaxed);
+            copy_frees = stats.frees.load(std::memory_order_relaxed);
+            copy_freed_bytes = stats.freed_bytes.load(std::memory_order_relaxed);
+            for (size_t bucket = 0; bucket < ZoneStats::buckets_count; bucket++) {
+                copy_buckets[bucket] = stats.buckets[bucket].load(std::memory_order_relaxed);
+            }
+            for (size_t counter = 0; counter < max_perf_counters; counter++) {
+                copy_perf[counter] = stats.perf[counter].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (version % 2 == 0 && stats.version.load(std::memory_order_relaxed) == version) {
+                break;
+            }
+        }
+
+        count += copy_count;
+        sum += copy_sum;
+        min = std::min(min, copy_min);
+        max = std::max(max, copy_max);
+        cpu += copy_cpu;
+        allocations += copy_allocations;
+        allocated_bytes += copy_allocated_bytes;
+        frees += copy_frees;
+        freed_bytes += copy_freed_bytes;
+        for (size_t bucket = 0; bucket < ZoneStats::buckets_count; bucket++) {
+            buckets[bucket] += copy_buckets[bucket];
+        }
+        for (size_t counter = 0; counter < max_perf_counters; counter++) {
+            perf[counter] += copy_perf[counter];
+        }
+    }
+
+    // Duration under which `quantile` of the zones ended, within the
+    // precision of the histogram buckets.
+    double percentile(double quantile) const {
+        uint64_t rank = static_cast<uint64_t>(quantile * double(count));
+        uint64_t seen = 0;
+        for (size_t bucket = 0; bucket < ZoneStats::buckets_count; bucket++) {
+            seen += buckets[bucket];
+            if (seen > rank) {
+                return std::clamp(ZoneStats::bucketValue(bucket), double(min), double(max));
+            }
+        }
+        return double(max);
+    }
+};
+
+// Merges the zone statistics of every thread, indexed by ZoneId.
+static std::vector<ZoneSummary> mergeZoneStats(const std::vector<ThreadProfiler *> &threads) {
+    std::vector<ZoneSummary> summaries;
+    for (ThreadProfiler *tprof : threads) {
+        tprof->zone_stats.forEach([&](ZoneId zone, const ZoneStats &stats) {
+            if (zone >= summaries.size()) {
+                summaries.resize(zone + 1);
+            }
+            summaries[zone].merge(stats);
+        });
+    }
+    return summaries;
+}
+
+// Writes the statistics of every zone as a table of microseconds.
+static void writeZoneStatsReport(const std::string &filename) {
+    std::ofstream report(filename);
+    if (!report) {
+        std::cerr << "Profiler: could not open " << filename << '\n';
+        return;
+    }
+
+    std::vector<ZoneStatistics> statistics = snapshotStats();
+    size_t name_width = 4;
+    for (const ZoneStatistics &zone : statistics) {
+        name_width = std::max(name_width, zone.name.size());
+    }
+
+    // CPU times and perf counters are averaged per profile point, heap
+    // allocations summed.
+    report << "Zone statistics of " << process_profiler->name << " (durations in microseconds)\n\n";
+    report << std::left << std::setw(name_width) << "zone" << std::right;
+    for (const char *column : {"count", "total", "mean", "min", "p50", "p99", "p999", "max"}) {
+        report << std::setw(14) << column;
+    }
+    if (process_profiler->thread_cpu_time) {
+        report << std::setw(14) << "cpu mean" << std::setw(14) << "off-cpu mean";
+    }
+    if (process_profiler->track_allocations) {
+        for (const char *column : {"allocs", "alloc bytes", "frees", "freed bytes"}) {
+            report << std::setw(14) << column;
+        }
+    }
+    if (!statistics.empty()) {
+        for (const auto &[counter, mean] : statistics.front().counters) {
+            report << std::setw(18) << counter;
+        }
+    }
+    report << '\n' << std::fixed << std::setprecision(3);
+    for (const ZoneStatistics &zone : statistics) {
+        report << std::left << std::setw(name_width) << zone.name << std::right << std::setw(14) << zone.count;
+        for (double ns : {zone.total, zone.mean, zone.min, zone.p50, zone.p99, zone.p999, zone.max}) {
+            report << std::setw(14) << ns / 1000;
+        }
+        if (process_profiler->thread_cpu_time) {
+            double count = double(zone.count);
+            report << std::setw(14) << zone.cpu_total / count / 1000 << std::setw(14) << zone.off_cpu_total / count / 1000;
+        }
+        if (process_profiler->track_allocations) {
+            for (uint64_t value : {zone.allocations, zone.allocated_bytes, zone.frees, zone.freed_bytes}) {
+                report << std::setw(14) << value;
+            }
+        }
+        for (const auto &[counter, mean] : zone.counters) {
+            report << std::setw(18) << mean;
+        }
+        report << '\n';
+    }
+}
+
+// Writes the frame times summary in milliseconds, with the longest frames at
+// their trace timestamp so they can be found in the timeline.
+static void writeFrameReport(const std::string &filename) {
+    FrameStats &frames = process_profiler->frames;
+    std::unique_lock<std::mutex> frames_lk(frames.mtx);
+    if (frames.marks < 2) {
+        return;
+    }
+
+    std::ofstream report(filename);
+    if (!report) {
+        std::cerr << "Profiler: could not open " << filename << '\n';
+        return;
+    }
+
+    calibrateTscClock();
+    ZoneSummary summary;
+    summary.merge(frames.durations);
+    auto ms = [](double ticks) { return toProfileNanoseconds(ticks) / 1e6; };
+
+    report << "Frame times of " << process_profiler->name << " (milliseconds)\n\n" << std::fixed << std::setprecision(3);
+    report << "frames " << summary.count << ", mean " << ms(double(summary.sum) / double(summary.count)) << ", min "
+           << ms(double(summary.min)) << ", p50 " << ms(summary.percentile(0.5)) << ", p99 " << ms(summary.percentile(0.99))
+           << ", max " << ms(double(summary.max)) << "\n\n";
+
+    report << std::setw(12) << "from" << std::setw(12) << "to" << std::setw(10) << "frames" << '\n';
+    uint64_t peak = *std::max_element(summary.buckets.begin(), summary.buckets.end());
+    for (size_t bucket = 0; bucket < ZoneStats::buckets_count; bucket++) {
+        if (uint64_t count = summary.buckets[bucket]) {
+            report << std::setw(12) << ms(double(ZoneStats::bucketStart(bucket))) << std::setw(12)
+                   << ms(double(ZoneStats::bucketStart(bucket + 1))) << std::setw(10) << count << ' '
+                   << std::string((count * 50 + peak - 1) / peak, '#') << '\n';
+        }
+    }
+
+    // Timestamps are the trace ones, in microseconds.
+    std::vector<FrameStats::Frame> worst = frames.worst;
+    std::sort(worst.begin(), worst.end(), [](const auto &a, const auto &b) { return a.duration > b.duration; });
+    report << "\nLongest frames\n" << std::setw(12) << "duration" << std::setw(20) << "start (us)" << '\n';
+    for (const FrameStats::Frame &frame : worst) {
+        report << std::setw(12) << ms(double(frame.duration)) << std::setw(20) << double(toProfileScale(frame.start)) / 1000 << '\n';
+    }
+}
+
+// Snapshot requests raised by the signal handler. Only async-signal-safe calls
+// are allowed there, so a dedicated thread waits for them.
+#ifndef _WIN32
+static sem_t snapshot_sem;
+
+static void requestSnapshot(int) { sem_post(&snapshot_sem); }
+
+static void runSnapshotListener() {
+    while (true) {
+        if (sem_wait(&snapshot_sem) == 0) {
+            dumpTracingSnapshot();
+        }
+    }
+}
+
+static void installSnapshotSignal() {
+    sem_init(&snapshot_sem, 0, 0);
+    std::thread(runSnapshotListener).detach();
+
+    struct sigaction action = {};
+    action.sa_handler = requestSnapshot;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &action, nullptr);
+}
+#else
+static void installSnapshotSignal() { std::cerr << "Profiler: GP_SNAPSHOT_SIGNAL is not supported on this platform\n"; }
+#endif
+
+// Stack sampling. Each instrumented thread arms a timer on its own CPU time,
+// which sends SIGPROF to that thread with its sample buffer attached.
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+// The handler walks the frame pointer chain of the interrupted code rather
+// than calling backtrace(), which may allocate or take the loader lock and is
+// not async-signal-safe. Each frame record holds the caller's frame pointer
+// then the return address, and records are only followed up the stack of the
+// thread, so a frame pointer clobbered by code built without them stops the
+// walk instead of faulting.
+static void recordSample(int, siginfo_t *info, void *ucontext) {
+    auto *samples = static_cast<SampleBuffer *>(info->si_value.sival_ptr);
+    if (info->si_code != SI_TIMER || samples == nullptr) {
+        return;
+    }
+
+    int saved_errno = errno;
+    ProfilerClock::rep time = ProfilerClock::ticks();
+    const mcontext_t &context = static_cast<ucontext_t *>(ucontext)->uc_mcontext;
+#ifdef __x86_64__
+    auto pc = static_cast<uintptr_t>(context.gregs[REG_RIP]);
+    auto fp = static_cast<uintptr_t>(context.gregs[REG_RBP]);
+#else
+    auto pc = static_cast<uintptr_t>(context.pc);
+    auto fp = static_cast<uintptr_t>(context.regs[29]);
+#endif
+    void *frames[max_sample_depth];
+    uint32_t depth = 0;
+    frames[depth++] = reinterpret_cast<void *>(pc);
+    while (depth < max_sample_depth && fp % alignof(uintptr_t) == 0 && fp >= samples->stack_low &&
+           fp + 2 * sizeof(uintptr_t) <= samples->stack_high) {
+        const auto *record = reinterpret_cast<const uintptr_t *>(fp);
+        if (record[1] == 0) {
+            break;
+        }
+        frames[depth++] = reinterpret_cast<void *>(record[1]);
+        if (record[0] <= fp) {
+            break;
+        }
+        fp = record[0];
+    }
+    samples->record(time, frames, depth);
+    errno = saved_errno;
+}
+
+static void installSampling() {
+    struct sigaction action = {};
+    action.sa_sigaction = recordSample;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigaction(SIGPROF, &action, nullptr);
+}
+
+// Only called by the thread owning `tprof`.
+static void startSampling(ThreadProfiler &tprof) {
+    tprof.samples = std::make_unique<SampleBuffer>();
+    tprof.samples->overwrite = process_profiler->flight_window.count() > 0;
+
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+        void *stack = nullptr;
+        size_t stack_size = 0;
+        if (pthread_attr_getstack(&attr, &stack, &stack_size) == 0) {
+            tprof.samples->stack_low = reinterpret_cast<uintptr_t>(stack);
+            tprof.samples->stack_high = tprof.samples->stack_low + stack_size;
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    struct sigevent event = {};
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_value.sival_ptr = tprof.samples.get();
+    event.sigev_notify_thread_id = static_cast<pid_t>(tprof.tid);
+
+    timer_t &timer = tprof.samples->timer;
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &timer) != 0) {
+        std::cerr << "Profiler: could not sample thread " << tprof.name << '\n';
+        return;
+    }
+    tprof.samples->has_timer = true;
+    auto interval = chrono::duration_cast<chrono::nanoseconds>(process_profiler->sample_interval).count();
+    struct itimerspec spec = {};
+    spec.it_interval.tv_sec = static_cast<time_t>(interval / 1000000000);
+    spec.it_interval.tv_nsec = static_cast<long>(interval % 1000000000);
+    spec.it_value = spec.it_interval;
+    timer_settime(timer, 0, &spec, nullptr);
+}
+#else
+static void installSampling() { std::cerr << "Profiler: GP_SAMPLE_INTERVAL_US is not supported on this platform\n"; }
+
+static void startSampling(ThreadProfiler &) {}
+#endif
+
+// Perf counters. Each instrumented thread opens its own group of events, which
+// only count while it runs.
+#ifdef __linux__
+static int openPerfEvent(uint32_t type, uint64_t config, int group_fd) {
+    struct perf_event_attr attr = {};
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_hv = 1;
+    int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC));
+    if (fd < 0 && (errno == EACCES || errno == EPERM)) {
+        // Restricted by perf_event_paranoid: count the user space only.
+        attr.exclude_kernel = 1;
+        fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC));
+    }
+    return fd;
+}
+
+// Only called by the thread owning `tprof`. Hardware counters are skipped when
+// the kernel does not expose them, as in most virtual machines.
+static void openPerfCounters(ThreadProfiler &tprof) {
+    static constexpr std::pair<uint32_t, uint64_t> events[max_perf_counters] = {
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK}, {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS}, {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS}, {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    };
+
+    auto perf = std::make_unique<PerfCounters>();
+    for (size_t counter = 0; counter < max_perf_counters; counter++) {
+        auto [type, config] = events[counter];
+        perf->fds[counter] = openPerfEvent(type, config, counter == 0 ? -1 : perf->fds[0]);
+        if (perf->fds[counter] >= 0) {
+            perf->opened |= 1u << counter;
+        } else if (counter == 0) {
+            std::cerr << "Profiler: could not count perf events of thread " << tprof.name << ": " << std::strerror(errno) << '\n';
+            return;
+        }
+    }
+    tprof.perf = std::move(perf);
+}
+#else
+static void openPerfCounters(ThreadProfiler &) {}
+#endif
+
+static void runTraceFlusher() {
+    UntrackedAllocations untracked;
+    std::unique_lock<std::mutex> flusher_lk(process_profiler->flusher_mtx);
+    while (!process_profiler->flusher_stop) {
+        process_profiler->flusher_cv.wait_for(flusher_lk, process_profiler->flush_interval,
+                                              [] { return process_profiler->flusher_stop; });
+
+        flusher_lk.unlock();
+        drainThreadProfilers(*process_profiler->writer);
+        process_profiler->writer->flush();
+        flusher_lk.lock();
+    }
+}
+
+static void stopTraceFlusher() {
+    if (!process_profiler->flusher.joinable()) {
+        return;
+    }
+
+    {
+        std::unique_lock<std::mutex> flusher_lk(process_profiler->flusher_mtx);
+        process_profiler->flusher_stop = true;
+    }
+    process_profiler->flusher_cv.notify_one();
+    process_profiler->flusher.join();
+}
+
+// API functions.
+// =============================================================================
+ZoneId registerZone(const ZoneDescriptor *zone) {
+    UntrackedAllocations untracked;
+    ZoneRegistry &registry = getZoneRegistry();
+    std::unique_lock<std::mutex> registry_lk(registry.mtx);
+
+    assert(registry.zones.size() < max_zones);
+    registry.zones.push_back(zone);
+    return static_cast<ZoneId>(registry.zones.size() - 1);
+}
+
+ZoneId internZone(const std::string &name) {
+    UntrackedAllocations untracked;
+    ZoneRegistry &registry = getZoneRegistry();
+    std::unique_lock<std::mutex> registry_lk(registry.mtx);
+
+    auto [it, inserted] = registry.interned_ids.try_emplace(name, 0);
+    if (inserted) {
+        assert(registry.zones.size() < max_zones);
+        const ZoneDescriptor &zone = registry.interned_zones.emplace_back(ZoneDescriptor{
+            .name = it->first.c_str(),
+            .file = "",
+            .line = 0,
+            .level = PROF_LVL_USER,
+        });
+        registry.zones.push_back(&zone);
+        it->second = static_cast<ZoneId>(registry.zones.size() - 1);
+    }
+    return it->second;
+}
+
+void initProcessProfiler(std::string &&process_name, int index) {
+    UntrackedAllocations untracked;
+    std::unique_lock<std::mutex> process_lk(process_profiler_mtx);
+
+    // Strong check: immediately return if process profiler is already intialized.
+    if (process_profiler != nullptr) {
+        return;
+    }
+
+    if (process_name.empty()) {
+        process_name = default_process_name;
+    }
+
+    // Create profile filename: filename_prefix + "_" + process_name + extension
+    std::string extension = ".json";
+    if (const char *env_str = std::getenv("GP_TRACE_FORMAT")) {
+        if (std::string(env_str) == "binary")
+            extension = binary_trace_extension;
+        else if (std::string(env_str) == "perfetto")
+            extension = perfetto_trace_extension;
+    }
+    if (const char *env_str = std::getenv("GP_TRACE_COMPRESSION")) {
+        std::string_view compression = std::string(env_str) == "zstd" ? zstd_extension : gzip_extension;
+        if (isCompressionSupported(compression))
+            extension += compression;
+        else
+            std::cerr << "Profiler: GP_TRACE_COMPRESSION=" << env_str << " is not supported by this build\n";
+    }
+
+    std::string filename = "_";
+    if (const char *env_str = std::getenv("GP_FILENAME_PREFIX"))
+        filename = std::string(env_str) + "_" + toLowerSnakeCase(process_name) + extension;
+
+    // Create a new process profiler.
+    // Select the clock before any entry is recorded.
+    if (const char *env_str = std::getenv("GP_CLOCK"); env_str && std::string(env_str) == "tsc") {
+        enableTscClock();
+    }
+
+    // Bound the chunks of each thread entry ring.
+    size_t buffer_size_mb = default_buffer_size_mb;
+    if (const char *env_str = std::getenv("GP_BUFFER_SIZE_MB"))
+        buffer_size_mb = std::stoul(env_str);
+
+    process_profiler = new ProcessProfiler{
+        .name = std::move(process_name),
+        .pid = id::Process::getProcessId(),
+        .index = index,
+        .filename = filename,
+        .enabled = !filename.empty(),
+        .buffer_chunks = std::max<uint64_t>(1, (buffer_size_mb << 20) / sizeof(EntryChunk)),
+    };
+
+    // Flight recorder: keep overwriting the oldest entries. Reclaiming needs a
+    // second chunk to keep filling.
+    if (const char *env_str = std::getenv("GP_FLIGHT_RECORDER_S")) {
+        process_profiler->flight_window = chrono::seconds(std::stoul(env_str));
+        process_profiler->buffer_chunks = std::max<uint64_t>(2, process_profiler->buffer_chunks);
+    }
+
+    // Aggregate zone durations, possibly instead of the timeline.
+    if (const char *env_str = std::getenv("GP_ZONE_STATS")) {
+        process_profiler->zone_stats = true;
+        process_profiler->timeline = std::string(env_str) != "only";
+    }
+
+    // Serialize the trace with every core unless told otherwise.
+    process_profiler->dump_threads = std::max(1u, std::thread::hardware_concurrency());
+    if (const char *env_str = std::getenv("GP_DUMP_THREADS"))
+        process_profiler->dump_threads = std::max(1ul, std::stoul(env_str));
+
+    // Start streaming the trace file in background if requested.
+    if (const char *env_str = std::getenv("GP_FLUSH_INTERVAL_MS")) {
+        if (process_profiler->flight_window.count() > 0) {
+            std::cerr << "Profiler: GP_FLUSH_INTERVAL_MS is ignored by the flight recorder\n";
+        } else {
+            process_profiler->flush_interval = chrono::milliseconds(std::stoul(env_str));
+        }
+    }
+    if (process_profiler->enabled && process_profiler->timeline && process_profiler->flush_interval.count() > 0) {
+        process_profiler->writer = openTraceWriter(process_profiler->filename);
+        if (process_profiler->writer != nullptr) {
+            process_profiler->flusher = std::thread(runTraceFlusher);
+        }
+    }
+
+    if (process_profiler->enabled && std::getenv("GP_SNAPSHOT_SIGNAL")) {
+        installSnapshotSignal();
+    }
+
+    // Attribute heap allocations to zones, in the statistics.
+    if (const char *env_str = std::getenv("GP_ALLOC_TRACKING")) {
+#ifndef PROF_TRACK_ALLOCATIONS
+        std::cerr << "Profiler: GP_ALLOC_TRACKING needs a build defining PROF_TRACK_ALLOCATIONS\n";
+#endif
+        static constexpr ZoneDescriptor heap_zone{"Heap bytes", __FILE__, __LINE__, PROF_LVL_USER};
+        process_profiler->heap_counter_zone = registerZone(&heap_zone);
+        process_profiler->heap_counter = process_profiler->timeline && std::string(env_str) == "counter";
+        process_profiler->zone_stats = true;
+        process_profiler->track_allocations = process_profiler->enabled;
+    }
+
+    // Measure the CPU time of the zones of the threads registered from now on.
+    process_profiler->thread_cpu_time = std::getenv("GP_THREAD_CPU_TIME") != nullptr;
+
+    // Count perf events in the threads registered from now on.
+    if (std::getenv("GP_PERF_COUNTERS")) {
+#ifdef __linux__
+        process_profiler->perf_counters = true;
+#else
+        std::cerr << "Profiler: GP_PERF_COUNTERS is not supported on this platform\n";
+#endif
+    }
+
+    // Sample the stacks of the threads registered from now on.
+    if (const char *env_str = std::getenv("GP_SAMPLE_INTERVAL_US")) {
+        process_profiler->sample_interval = chrono::microseconds(std::stoul(env_str));
+        if (process_profiler->enabled && process_profiler->timeline && process_profiler->sample_interval.count() > 0) {
+            installSampling();
+        }
+    }
+}
+
+void initThreadProfiler(std::string &&thread_name, int index) {
+    UntrackedAllocations untracked;
+    // Weak check: init process profiler if it is needed.
+    // Avoids double locking `process_profiler_mtx`.
+    if (process_profiler == nullptr) {
+        initProcessProfiler();
+    }
 
     if (!process_profiler->enabled) {
         return;
@@ -234,79 +2394,457 @@ void dumpTracingFile() {
 
     std::unique_lock<std::mutex> process_lk(process_profiler_mtx);
 
-    assert(std::all_of(process_profiler->threads_profile.begin(), process_profiler->threads_profile.end(),
-                       [](const ThreadProfiler &tprof) { return tprof.stack.empty(); }));
-
-    // Counting entries to generate buffer
-    //  Two for process metadata
-    /* uint64_t count = 2; */
-    /* for (const auto &tprof : process_profiler->threads_profile) { */
-    /*     // one for each entry in the thread */
-    /*     count += tprof.entries.size(); */
-    /**/
-    /*     // two for the thread metadata_name */
-    /*     count += 2; */
-    /* } */
-    /**/
-    // Start JSON file.
-    using json = nlohmann::json;
-
-    std::vector<json> entry_vec;
-    // Traced Events
-    for (const auto &tprof : process_profiler->threads_profile) {
-        for (const auto &entry : tprof.entries) {
-            json prof_entry;
-            prof_entry["ph"] = "X";
-            prof_entry["name"] = entry.name;
-            prof_entry["pid"] = process_profiler->pid;
-            prof_entry["tid"] = static_cast<int64_t>(tprof.tid);
-            prof_entry["ts"] = toProfileScale(entry.start);
-            prof_entry["dur"] = toProfileScale(entry.end - entry.start);
-            prof_entry["args"] = entry.details;
-
-            entry_vec.push_back(prof_entry);
-        }
-    }
-    // Metadata
-    // Naming and ordering of processes.
-    json metadata_name;
-    metadata_name["ph"] = "M";
-    metadata_name["name"] = "process_name";
-    metadata_name["pid"] = process_profiler->pid;
-    metadata_name["args"] = json::object({{"name", process_profiler->name}});
-
-    json metadata_sort_index;
-    metadata_sort_index["ph"] = "M";
-    metadata_sort_index["name"] = "process_sort_index";
-    metadata_sort_index["pid"] = process_profiler->pid;
-    metadata_sort_index["args"] = json::object({{"sort_index", process_profiler->index}});
-    entry_vec.push_back(metadata_name);
-    entry_vec.push_back(metadata_sort_index);
-
-    // Naming and ordering of threads
-    for (const auto &tprof : process_profiler->threads_profile) {
-        json naming_thread;
-        naming_thread["ph"] = "M";
-        naming_thread["name"] = "thread_name";
-        naming_thread["pid"] = process_profiler->pid;
-        naming_thread["tid"] = static_cast<int64_t>(tprof.tid);
-        naming_thread["args"] = json::object({{"name", tprof.name}});
-
-        json sorting_thread;
-        sorting_thread["ph"] = "M";
-        sorting_thread["name"] = "process_sort_index";
-        sorting_thread["pid"] = process_profiler->pid;
-        sorting_thread["tid"] = static_cast<int64_t>(tprof.tid);
-        sorting_thread["args"] = json::object({{"sort_index", tprof.index}});
-        entry_vec.push_back(naming_thread);
-        entry_vec.push_back(sorting_thread);
-    }
-
-    json trace;
-    trace["traceEvents"] = entry_vec;
-
-    std::ofstream out(process_profiler->filename);
-    out << std::setw(4) << trace << std::endl;
+    if (thread_profiler != nullptr) {
+        return;
+    }
+
+    if (thread_name.empty()) {
+        thread_name = default_thread_name;
+    }
+
+    // Create new thread profiler and set thread local reference. Its entry
+    // buffer is not movable, so it is built in place.
+    ThreadProfiler &tprof = process_profiler->threads_profile.emplace_back();
+    tprof.name = std::move(thread_name);
+    tprof.tid = id::Thread::getThreadId();
+    tprof.index = index;
+    tprof.entries.max_chunks = process_profiler->buffer_chunks;
+    tprof.entries.overwrite = process_profiler->flight_window.count() > 0;
+    thread_profiler = &tprof;
+
+    if (process_profiler->timeline && process_profiler->sample_interval.count() > 0) {
+        startSampling(tprof);
+    }
+    if (process_profiler->perf_counters) {
+        openPerfCounters(tprof);
+    }
+    if (process_profiler->thread_cpu_time) {
+        tprof.cpu_begins = std::make_unique<int64_t[]>(max_stack_depth);
+    }
+}
+
+static void addBufferStats(BufferStats &stats, ThreadProfiler &tprof) {
+    stats.entries += tprof.entries.count();
+    stats.bytes += tprof.entries.bytes.load(std::memory_order_relaxed);
+    stats.dropped += tprof.entries.dropped.load(std::memory_order_relaxed);
+
+    std::unique_lock<std::mutex> read_lk(tprof.entries.read_mtx);
+    stats.overwritten += tprof.entries.overwritten;
+}
+
+BufferStats getBufferStats() {
+    BufferStats stats;
+    if (process_profiler == nullptr) {
+        return stats;
+    }
+
+    std::unique_lock<std::mutex> process_lk(process_profiler_mtx);
+    for (auto &tprof : process_profiler->threads_profile) {
+        addBufferStats(stats, tprof);
+    }
+    return stats;
+}
+
+BufferStats getThreadBufferStats() {
+    BufferStats stats;
+    if (thread_profiler != nullptr) {
+        addBufferStats(stats, *thread_profiler);
+    }
+    return stats;
+}
+
+// Only the readers list the threads under `process_profiler_mtx`; recording
+// threads update their statistics without any lock.
+std::vector<ZoneStatistics> snapshotStats() {
+    UntrackedAllocations untracked;
+    std::vector<ZoneStatistics> statistics;
+    if (process_profiler == nullptr || !process_profiler->zone_stats) {
+        return statistics;
+    }
+
+    calibrateTscClock();
+    std::vector<ThreadProfiler *> threads = listThreadProfilers();
+    std::vector<ZoneSummary> summaries = mergeZoneStats(threads);
+    uint32_t perf_opened = 0;
+    for (ThreadProfiler *tprof : threads) {
+        perf_opened |= tprof->perf != nullptr ? tprof->perf->opened : 0;
+    }
+    ZoneNames zones;
+    for (ZoneId zone = 0; zone < summaries.size(); zone++) {
+        const ZoneSummary &summary = summaries[zone];
+        if (summary.count == 0) {
+            continue;
+        }
+        std::vector<std::pair<std::string, double>> counters;
+        for (size_t counter = 0; counter < max_perf_counters; counter++) {
+            if (perf_opened >> counter & 1) {
+                counters.emplace_back(perf_counter_names[counter], double(summary.perf[counter]) / double(summary.count));
+            }
+        }
+        double total = toProfileNanoseconds(double(summary.sum));
+        double cpu_total = double(summary.cpu);
+        statistics.push_back(ZoneStatistics{
+            .name = zones[zone],
+            .count = summary.count,
+            .total = total,
+            .mean = toProfileNanoseconds(double(summary.sum) / double(summary.count)),
+            .min = toProfileNanoseconds(double(summary.min)),
+            .p50 = toProfileNanoseconds(summary.percentile(0.5)),
+            .p99 = toProfileNanoseconds(summary.percentile(0.99)),
+            .p999 = toProfileNanoseconds(summary.percentile(0.999)),
+            .max = toProfileNanoseconds(double(summary.max)),
+            .cpu_total = cpu_total,
+            .off_cpu_total = process_profiler->thread_cpu_time ? std::max(total - cpu_total, 0.0) : 0,
+            .allocations = summary.allocations,
+            .allocated_bytes = summary.allocated_bytes,
+            .frees = summary.frees,
+            .freed_bytes = summary.freed_bytes,
+            .counters = std::move(counters),
+        });
+    }
+    std::sort(statistics.begin(), statistics.end(), [](const ZoneStatistics &a, const ZoneStatistics &b) { return a.total > b.total; });
+    return statistics;
+}
+
+void beginProfilePoint(ZoneId zone) {
+    // Weak check: init thread profiler if it is needed.
+    // Avoids locking `process_prosfiler_mtx`.
+    if (thread_profiler == nullptr) {
+        initThreadProfiler();
+    }
+
+    if (!process_profiler->enabled) {
+        return;
+    }
+
+    // Add new entry to local profiler stack.
+    Entry entry{.zone = zone};
+    entry.start = ProfilerClock::ticks();
+    pushStackEntry(*thread_profiler, entry);
+}
+
+void beginProfilePoint(ZoneId zone, const std::string &&details) {
+    if (thread_profiler == nullptr) {
+        initThreadProfiler();
+    }
+
+    if (!process_profiler->enabled) {
+        return;
+    }
+
+    // Details only show in the timeline, so statistics alone do not keep them.
+    if (!process_profiler->timeline) {
+        beginProfilePoint(zone);
+        return;
+    }
+
+    // Details are copied like typed arguments, by entries that get recorded.
+    Entry entry{.zone = zone};
+    if (details != "{}" && stackDepth(*thread_profiler) < max_stack_depth) {
+        entry.details = stackDetails(*thread_profiler, details);
+    }
+    entry.start = ProfilerClock::ticks();
+    pushStackEntry(*thread_profiler, entry);
+}
+
+void beginProfilePoint(ZoneId zone, const ZoneArg *args, size_t count) {
+    if (thread_profiler == nullptr) {
+        initThreadProfiler();
+    }
+
+    if (!process_profiler->enabled) {
+        return;
+    }
+
+    // Arguments are only kept for the timeline, by entries that get recorded.
+    Entry entry{.zone = zone};
+    if (process_profiler->timeline && stackDepth(*thread_profiler) < max_stack_depth) {
+        entry.details = stackArgs(*thread_profiler, args, count);
+    }
+    entry.start = ProfilerClock::ticks();
+    pushStackEntry(*thread_profiler, entry);
+}
+
+void beginProfilePoint(const std::string &&name, const std::string &&details) {
+    assert(name != "");
+
+    if (details == "{}") {
+        beginProfilePoint(internZone(name));
+    } else {
+        beginProfilePoint(internZone(name), std::move(details));
+    }
+}
+
+void recordCounter(ZoneId counter, double value) {
+    if (thread_profiler == nullptr) {
+        initThreadProfiler();
+    }
+
+    if (!process_profiler->enabled || !process_profiler->timeline) {
+        return;
+    }
+
+    Entry entry = Entry::make(EntryKind::counter, counter, ProfilerClock::ticks(), std::bit_cast<ProfilerClock::rep>(value));
+    thread_profiler->entries.push(entry);
+}
+
+void recordInstant(ZoneId instant, InstantScope scope) {
+    if (thread_profiler == nullptr) {
+        initThreadProfiler();
+    }
+
+    if (!process_profiler->enabled || !process_profiler->timeline) {
+        return;
+    }
+
+    Entry entry = Entry::make(EntryKind::instant, instant, ProfilerClock::ticks(), 0);
+    entry.details = static_cast<uint32_t>(scope);
+    thread_profiler->entries.push(entry);
+}
+
+void markFrame() {
+    static constexpr ZoneDescriptor frame_zone{"Frame", __FILE__, __LINE__, PROF_LVL_USER};
+    static const ZoneId frame_id = registerZone(&frame_zone);
+
+    if (thread_profiler == nullptr) {
+        initThreadProfiler();
+    }
+
+    if (!process_profiler->enabled) {
+        return;
+    }
+
+    ProfilerClock::rep mark = ProfilerClock::ticks();
+    if (process_profiler->timeline) {
+        Entry entry = Entry::make(EntryKind::instant, frame_id, mark, 0);
+        entry.details = static_cast<uint32_t>(InstantScope::process);
+        thread_profiler->entries.push(entry);
+    }
+    process_profiler->frames.record(mark);
+}
+
+void recordFlow(ZoneId flow, FlowPhase phase, FlowId id) {
+    if (thread_profiler == nullptr) {
+        initThreadProfiler();
+    }
+
+    if (!process_profiler->enabled || !process_profiler->timeline) {
+        return;
+    }
+
+    Entry entry = Entry::make(EntryKind::flow, flow, ProfilerClock::ticks(), static_cast<ProfilerClock::rep>(id));
+    entry.details = static_cast<uint32_t>(phase);
+    thread_profiler->entries.push(entry);
+}
+
+AsyncSpan beginAsyncSpan(ZoneId name, ZoneId category) {
+    if (process_profiler == nullptr || !process_profiler->enabled || !process_profiler->timeline) {
+        return AsyncSpan{};
+    }
+    return AsyncSpan{name, category, newFlowId(), ProfilerClock::ticks()};
+}
+
+// Both events are pushed when the span ends, so they are dumped together
+// unless the begin falls before the flight recorder window.
+void endAsyncSpan(const AsyncSpan &span) {
+    if (span.id == 0) {
+        return;
+    }
+    if (thread_profiler == nullptr) {
+        initThreadProfiler();
+    }
+
+    ProfilerClock::rep end = ProfilerClock::ticks();
+    Entry begin = Entry::make(EntryKind::async_begin, span.name, span.start, static_cast<ProfilerClock::rep>(span.id));
+    begin.details = span.category;
+    Entry entry = Entry::make(EntryKind::async_end, span.name, end, static_cast<ProfilerClock::rep>(span.id));
+    entry.details = span.category;
+    thread_profiler->entries.push(begin);
+    thread_profiler->entries.push(entry);
+}
+
+// Records the live heap bytes at `time` when they changed since the thread
+// last did.
+static void recordHeapCounter(ThreadProfiler &tprof, ProfilerClock::rep time) {
+    int64_t heap_bytes = process_profiler->heap_bytes.load(std::memory_order_relaxed);
+    if (heap_bytes != std::exchange(tprof.heap_recorded, heap_bytes)) {
+        double value = static_cast<double>(heap_bytes);
+        ZoneId counter = process_profiler->heap_counter_zone;
+        tprof.entries.push(Entry::make(EntryKind::counter, counter, time, std::bit_cast<ProfilerClock::rep>(value)));
+    }
+}
+
+// Allocations made before the thread is instrumented, or outside any zone,
+// only count in the live heap bytes.
+static void recordHeapChange(int64_t bytes) {
+    if (untracked_allocations || process_profiler == nullptr || !process_profiler->track_allocations) {
+        return;
+    }
+    UntrackedAllocations untracked;
+    if (process_profiler->heap_counter) {
+        process_profiler->heap_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    ThreadProfiler *tprof = thread_profiler;
+    uint32_t depth = tprof != nullptr ? std::min<uint32_t>(stackDepth(*tprof), max_stack_depth) : 0;
+    if (depth > 0) {
+        if (ZoneStats *stats = tprof->zone_stats.get(loadStackEntry(*tprof, depth - 1).zone)) {
+            stats->recordHeap(bytes);
+        }
+    }
+}
+
+void recordAllocation(size_t bytes) { recordHeapChange(static_cast<int64_t>(bytes)); }
+
+void recordDeallocation(size_t bytes) { recordHeapChange(-static_cast<int64_t>(bytes)); }
+
+void endProfilePoint() {
+    assert(process_profiler != nullptr);
+
+    if (!process_profiler->enabled) {
+        return;
+    }
+
+    assert(thread_profiler != nullptr);
+    assert(stackDepth(*thread_profiler) > 0);
+
+    // Finish top stack entry and move it to the entries buffer. The stack slot
+    // is left untouched for concurrent snapshots.
+    uint64_t state = thread_profiler->stack_state.load(std::memory_order_relaxed) - 1;
+    thread_profiler->stack_state.store(state, std::memory_order_relaxed);
+
+    uint32_t depth = static_cast<uint32_t>(state);
+    EntryBuffer &entries = thread_profiler->entries;
+    if (depth >= max_stack_depth) {
+        entries.dropped.store(entries.dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return;
+    }
+    Entry entry = loadStackEntry(*thread_profiler, depth);
+
+    // Typed arguments or details are popped from the argument stack, to be
+    // pushed ahead of the entry.
+    uint32_t arg_records = entry.details;
+    const Entry *args = nullptr;
+    if (arg_records > 0) {
+        thread_profiler->args->top -= arg_records;
+        args = thread_profiler->args->records + thread_profiler->args->top;
+        entry.details = 0;
+    }
+
+    // Measurements since the begin, pushed ahead of the entry: perf deltas two
+    // per entry, then the CPU time. The perf counters are read first, so that
+    // the CPU time and the end are read together on the same side of them.
+    PerfCounters *perf = thread_profiler->perf.get();
+    uint64_t perf_deltas[max_perf_counters + 1] = {};
+    if (perf != nullptr) {
+        perf->read(perf_deltas);
+        for (size_t counter = 0; counter < max_perf_counters; counter++) {
+            perf_deltas[counter] -= perf->begins[depth][counter];
+        }
+    }
+    int64_t cpu_ns = 0;
+    if (thread_profiler->cpu_begins != nullptr) {
+        cpu_ns = std::max<int64_t>(ThreadCpuClock::nanoseconds() - thread_profiler->cpu_begins[depth], 0);
+    }
+    ProfilerClock::rep end = ProfilerClock::ticks();
+    entry.end = end;
+
+    if (process_profiler->zone_stats) {
+        if (ZoneStats *stats = thread_profiler->zone_stats.get(entry.zone)) {
+            stats->record(static_cast<uint64_t>(std::max<ProfilerClock::rep>(end - entry.start, 0)), perf ? perf_deltas : nullptr,
+                          static_cast<uint64_t>(cpu_ns));
+        }
+    }
+    if (!process_profiler->timeline) {
+        return;
+    }
+    constexpr uint32_t perf_entries = (max_perf_counters + 1) / 2;
+    uint32_t count = arg_records + (perf != nullptr ? perf_entries : 0) + (thread_profiler->cpu_begins != nullptr ? 1 : 0) + 1;
+    if (count == 1) {
+        entries.push(entry);
+    } else if (Entry *group = entries.reserve(count)) {
+        group = std::copy(args, args + arg_records, group);
+        for (uint32_t pair = 0; perf != nullptr && pair < perf_entries; pair++) {
+            *group = Entry::make(EntryKind::perf, 0, static_cast<ProfilerClock::rep>(perf_deltas[2 * pair]),
+                                 static_cast<ProfilerClock::rep>(perf_deltas[2 * pair + 1]));
+            group++->details = pair;
+        }
+        if (thread_profiler->cpu_begins != nullptr) {
+            *group++ = Entry::make(EntryKind::cpu_time, 0, cpu_ns, 0);
+        }
+        *group = entry;
+        entries.commit(count);
+    }
+    if (process_profiler->heap_counter) {
+        recordHeapCounter(*thread_profiler, end);
+    }
+}
+
+void dumpTracingFile() {
+    UntrackedAllocations untracked;
+    assert(process_profiler != nullptr);
+
+    if (!process_profiler->enabled) {
+        return;
+    }
+
+    // The flusher hands its open trace file over to the final drain.
+    stopTraceFlusher();
+    std::unique_ptr<TraceWriter> writer = std::move(process_profiler->writer);
+
+    std::vector<ThreadProfiler *> threads = listThreadProfilers();
+    assert(std::all_of(threads.begin(), threads.end(), [](const ThreadProfiler *tprof) { return stackDepth(*tprof) == 0; }));
+
+    // Stream the events straight from the thread buffers into the file.
+    if (writer == nullptr && process_profiler->timeline) {
+        writer = openTraceWriter(process_profiler->filename);
+    }
+    if (writer != nullptr) {
+        drainThreadProfilers(*writer, flightWindowStart(threads));
+    }
+
+    // Zone statistics filename: trace filename + "_stats.txt", instead of the
+    // extensions.
+    if (process_profiler->zone_stats) {
+        const std::string &filename = process_profiler->filename;
+        writeZoneStatsReport(filename.substr(0, extensionPosition(filename)) + "_stats.txt");
+    }
+
+    // Frame times filename: trace filename + "_frames.txt", instead of the
+    // extensions.
+    const std::string &filename = process_profiler->filename;
+    writeFrameReport(filename.substr(0, extensionPosition(filename)) + "_frames.txt");
+
+    // Report the entries that did not fit in the thread rings.
+    for (ThreadProfiler *tprof : threads) {
+        if (uint64_t dropped = tprof->entries.dropped.load(std::memory_order_relaxed)) {
+            std::cerr << "Profiler: thread " << tprof->name << " dropped " << dropped << " entries\n";
+        }
+        if (tprof->samples != nullptr) {
+            if (uint64_t dropped = tprof->samples->dropped.load(std::memory_order_relaxed)) {
+                std::cerr << "Profiler: thread " << tprof->name << " dropped " << dropped << " stack samples\n";
+            }
+        }
+    }
+}
+
+void dumpTracingSnapshot() {
+    UntrackedAllocations untracked;
+    if (process_profiler == nullptr || !process_profiler->enabled) {
+        return;
+    }
+
+    std::unique_lock<std::mutex> snapshot_lk(process_profiler->snapshot_mtx);
+
+    // Snapshot filename: trace filename + "_snapshot_" + count, before the
+    // format and compression extensions.
+    std::string filename = process_profiler->filename;
+    std::string suffix = "_snapshot_" + std::to_string(process_profiler->snapshot_count++);
+    filename.insert(extensionPosition(filename), suffix);
+
+    if (std::unique_ptr<TraceWriter> writer = openTraceWriter(filename)) {
+        writeSnapshot(*writer);
+    }
 }
 
 } // namespace _profiler
@@ -0,0 +1,288 @@
+//===------- trace_writer.cpp - Profiler trace output interfaces ---------===//
+//
+// Definitions of the buffered, optionally compressed, files the trace formats
+// are written to and read from.
+//
+//===----------------------------------------------------------------------===//
+#ifdef TRACY_ENABLE
+
+#include "trace_writer.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+#ifdef PROF_HAS_ZLIB
+#include <zlib.h>
+#endif
+#ifdef PROF_HAS_ZSTD
+#include <zstd.h>
+#endif
+
+namespace _profiler {
+
+// ============================================================================
+// ========================= Compression codecs ===============================
+// ============================================================================
+
+// Streaming compression of an output file, or decompression of an input file.
+class Codec {
+public:
+    enum class Flush { none, sync, finish };
+
+    virtual ~Codec() = default;
+
+    // Compresses `data` into `file`. `sync` makes the data written so far
+    // decompressible and `finish` ends the stream.
+    virtual void compress(std::string_view data, Flush flush, std::FILE *file) = 0;
+
+    // Decompresses up to `size` bytes from `file` into `data`.
+    virtual size_t decompress(char *data, size_t size, std::FILE *file) = 0;
+
+protected:
+    static constexpr size_t chunk_size = 1 << 18;
+
+    std::unique_ptr<char[]> chunk{new char[chunk_size]}; // Compressed bytes
+};
+
+#ifdef PROF_HAS_ZLIB
+// Gzip stream. Compression favours speed, the dump being I/O bound.
+class GzipCodec : public Codec {
+public:
+    explicit GzipCodec(bool output) : output(output) {
+        // 16 selects the gzip header; 32 detects it when decompressing.
+        if (output) {
+            deflateInit2(&stream, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+        } else {
+            inflateInit2(&stream, 15 + 32);
+        }
+    }
+
+    ~GzipCodec() override {
+        if (output) {
+            deflateEnd(&stream);
+        } else {
+            inflateEnd(&stream);
+        }
+    }
+
+    void compress(std::string_view data, Flush flush, std::FILE *file) override {
+        int mode = flush == Flush::finish ? Z_FINISH : flush == Flush::sync ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+        stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+        stream.avail_in = data.size();
+        do {
+            stream.next_out = reinterpret_cast<Bytef *>(chunk.get());
+            stream.avail_out = chunk_size;
+            if (deflate(&stream, mode) == Z_STREAM_ERROR) {
+                return;
+            }
+            std::fwrite(chunk.get(), 1, chunk_size - stream.avail_out, file);
+        } while (stream.avail_out == 0);
+    }
+
+    size_t decompress(char *data, size_t size, std::FILE *file) override {
+        stream.next_out = reinterpret_cast<Bytef *>(data);
+        stream.avail_out = size;
+        while (stream.avail_out > 0) {
+            if (stream.avail_in == 0) {
+                stream.next_in = reinterpret_cast<Bytef *>(chunk.get());
+                stream.avail_in = std::fread(chunk.get(), 1, chunk_size, file);
+                if (stream.avail_in == 0) {
+                    break;
+                }
+            }
+            int status = inflate(&stream, Z_NO_FLUSH);
+            if (status == Z_STREAM_END) {
+                // Concatenated gzip members are read as one stream.
+                inflateReset(&stream);
+            } else if (status != Z_OK) {
+                break;
+            }
+        }
+        return size - stream.avail_out;
+    }
+
+private:
+    bool output;
+    z_stream stream = {};
+};
+#endif // PROF_HAS_ZLIB
+
+#ifdef PROF_HAS_ZSTD
+// Zstandard stream, at the default compression level.
+class ZstdCodec : public Codec {
+public:
+    explicit ZstdCodec(bool output) {
+        if (output) {
+            cctx = ZSTD_createCCtx();
+        } else {
+            dctx = ZSTD_createDCtx();
+        }
+    }
+
+    ~ZstdCodec() override {
+        ZSTD_freeCCtx(cctx);
+        ZSTD_freeDCtx(dctx);
+    }
+
+    void compress(std::string_view data, Flush flush, std::FILE *file) override {
+        ZSTD_EndDirective mode = flush == Flush::finish ? ZSTD_e_end : flush == Flush::sync ? ZSTD_e_flush : ZSTD_e_continue;
+        ZSTD_inBuffer in = {data.data(), data.size(), 0};
+        bool done = false;
+        while (!done) {
+            ZSTD_outBuffer out = {chunk.get(), chunk_size, 0};
+            size_t remaining = ZSTD_compressStream2(cctx, &out, &in, mode);
+            if (ZSTD_isError(remaining)) {
+                return;
+            }
+            std::fwrite(chunk.get(), 1, out.pos, file);
+            done = mode == ZSTD_e_continue ? in.pos == in.size : remaining == 0;
+        }
+    }
+
+    size_t decompress(char *data, size_t size, std::FILE *file) override {
+        ZSTD_outBuffer out = {data, size, 0};
+        while (out.pos < out.size) {
+            if (in.pos == in.size) {
+                in = {chunk.get(), std::fread(chunk.get(), 1, chunk_size, file), 0};
+                if (in.size == 0) {
+                    break;
+                }
+            }
+            if (ZSTD_isError(ZSTD_decompressStream(dctx, &out, &in))) {
+                break;
+            }
+        }
+        return out.pos;
+    }
+
+private:
+    ZSTD_CCtx *cctx = nullptr;
+    ZSTD_DCtx *dctx = nullptr;
+    ZSTD_inBuffer in = {nullptr, 0, 0}; // Compressed bytes left to decompress
+};
+#endif // PROF_HAS_ZSTD
+
+// Codec of the files ending with `filename`'s extension, null if not
+// compressed.
+static std::unique_ptr<Codec> makeCodec([[maybe_unused]] std::string_view filename, [[maybe_unused]] bool output) {
+#ifdef PROF_HAS_ZLIB
+    if (filename.ends_with(gzip_extension)) {
+        return std::make_unique<GzipCodec>(output);
+    }
+#endif
+#ifdef PROF_HAS_ZSTD
+    if (filename.ends_with(zstd_extension)) {
+        return std::make_unique<ZstdCodec>(output);
+    }
+#endif
+    return nullptr;
+}
+
+bool isCompressionSupported(std::string_view extension) {
+    return makeCodec(extension, true) != nullptr;
+}
+
+std::string_view withoutCompressionExtension(std::string_view filename) {
+    for (std::string_view extension : {gzip_extension, zstd_extension}) {
+        if (filename.ends_with(extension)) {
+            return filename.substr(0, filename.size() - extension.size());
+        }
+    }
+    return filename;
+}
+
+// Compressed files this build cannot handle are not opened at all rather
+// than holding data under a misleading extension.
+static bool isFileSupported(std::string_view filename) {
+    return withoutCompressionExtension(filename) == filename || isCompressionSupported(filename);
+}
+
+// ============================================================================
+// ============================== Output ======================================
+// ============================================================================
+
+TraceOutput::TraceOutput() : buffer(new char[buffer_size]), in_memory(true) {}
+
+TraceOutput::TraceOutput(const std::string &filename) : buffer(new char[buffer_size]) {
+    if (isFileSupported(filename)) {
+        file = std::fopen(filename.c_str(), "wb");
+        codec = makeCodec(filename, true);
+    }
+}
+
+TraceOutput::~TraceOutput() {
+    drain();
+    if (file != nullptr) {
+        if (codec != nullptr) {
+            codec->compress({}, Codec::Flush::finish, file);
+        }
+        std::fclose(file);
+    }
+}
+
+void TraceOutput::put(std::string_view str) {
+    while (!str.empty()) {
+        if (used == buffer_size) {
+            drain();
+        }
+        size_t n = std::min(str.size(), buffer_size - used);
+        std::memcpy(&buffer[used], str.data(), n);
+        used += n;
+        str.remove_prefix(n);
+    }
+}
+
+void TraceOutput::flush() {
+    drain(true);
+    if (file != nullptr) {
+        std::fflush(file);
+    }
+}
+
+std::string TraceOutput::take() {
+    drain();
+    return std::exchange(memory, {});
+}
+
+void TraceOutput::drain(bool sync) {
+    if (in_memory) {
+        memory.append(buffer.get(), used);
+    } else if (file != nullptr && codec != nullptr && (used != 0 || sync)) {
+        codec->compress(std::string_view(buffer.get(), used), sync ? Codec::Flush::sync : Codec::Flush::none, file);
+    } else if (file != nullptr && used != 0) {
+        std::fwrite(buffer.get(), 1, used, file);
+    }
+    used = 0;
+}
+
+// ============================================================================
+// ============================== Input =======================================
+// ============================================================================
+
+TraceInput::TraceInput(const std::string &filename) {
+    if (isFileSupported(filename)) {
+        file = std::fopen(filename.c_str(), "rb");
+        codec = makeCodec(filename, false);
+    }
+}
+
+TraceInput::~TraceInput() {
+    if (file != nullptr) {
+        std::fclose(file);
+    }
+}
+
+size_t TraceInput::read(char *data, size_t size) {
+    if (file == nullptr) {
+        return 0;
+    }
+    if (codec != nullptr) {
+        return codec->decompress(data, size, file);
+    }
+    return std::fread(data, 1, size, file);
+}
+
+} // namespace _profiler
+
+#endif // TRACY_ENABLE
@@ -0,0 +1,187 @@
+//===------- trace_writer.hpp - Profiler trace output interfaces ---------===//
+//
+// Declarations of the interface implemented by every trace format and of the
+// buffered, optionally compressed, files they are written to and read from.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef _TRACE_WRITER_H
+#define _TRACE_WRITER_H
+
+#ifdef TRACY_ENABLE
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace _profiler {
+
+/// Extensions of the compressed trace files.
+inline constexpr std::string_view gzip_extension = ".gz";
+inline constexpr std::string_view zstd_extension = ".zst";
+
+/// Whether trace files compressed as given by \p extension can be written
+/// and read by this build.
+bool isCompressionSupported(std::string_view extension);
+
+/// \p filename without its compression extension, if any.
+std::string_view withoutCompressionExtension(std::string_view filename);
+
+/// Streaming compression or decompression of a file.
+class Codec;
+
+/// Buffered output file.
+///
+/// Data is gathered into a fixed-size buffer that is written to the file
+/// whenever it fills up, so writers can emit small pieces cheaply. Files
+/// ending with a compression extension are compressed on the fly.
+class TraceOutput {
+public:
+    /// Output gathered in memory, to be taken with take().
+    TraceOutput();
+
+    /// Open \p filename for writing.
+    explicit TraceOutput(const std::string &filename);
+    TraceOutput(const TraceOutput &) = delete;
+    TraceOutput &operator=(const TraceOutput &) = delete;
+
+    /// Write the remaining data and close the file.
+    ~TraceOutput();
+
+    /// Whether the file could be opened.
+    bool isOpen() const { return file != nullptr || in_memory; }
+
+    void put(char c) {
+        if (used == buffer_size) {
+            drain();
+        }
+        buffer[used++] = c;
+    }
+
+    void put(std::string_view str);
+
+    /// Write the buffered data to the file. Compressed data written so far
+    /// can be decompressed once flushed.
+    void flush();
+
+    /// Take the data written so far to a memory output.
+    std::string take();
+
+private:
+    static constexpr size_t buffer_size = 1 << 20;
+
+    void drain(bool sync = false);
+
+    std::FILE *file = nullptr;
+    std::unique_ptr<Codec> codec;
+    std::unique_ptr<char[]> buffer;
+    size_t used = 0;
+    bool in_memory = false;
+    std::string memory; // Data drained from a memory output
+};
+
+/// Input file, decompressed on the fly when it ends with a compression
+/// extension.
+class TraceInput {
+public:
+    /// Open \p filename for reading.
+    explicit TraceInput(const std::string &filename);
+    TraceInput(const TraceInput &) = delete;
+    TraceInput &operator=(const TraceInput &) = delete;
+
+    ~TraceInput();
+
+    /// Whether the file could be opened.
+    bool isOpen() const { return file != nullptr; }
+
+    /// Read up to \p size bytes into \p data.
+    ///
+    /// \returns the number of bytes read, 0 at the end of the file or on
+    /// error.
+    size_t read(char *data, size_t size);
+
+private:
+    std::FILE *file = nullptr;
+    std::unique_ptr<Codec> codec;
+};
+
+/// Streaming writer of a trace format.
+///
+/// Timestamps and durations are given in nanoseconds. Events of a thread are
+/// written after its metadata.
+///
+/// Parts of a trace can be written concurrently into fragments, each used by
+/// a single thread, then appended to the writer in the order they belong.
+class TraceWriter {
+public:
+    virtual ~TraceWriter() = default;
+
+    /// Whether the output file could be opened.
+    virtual bool isOpen() const = 0;
+
+    /// Write a profile point that began and ended.
+    ///
+    /// \param args of the profile point, as a JSON object.
+    virtual void completeEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t start_ns, int64_t duration_ns,
+                               std::string_view args) = 0;
+
+    /// Write a profile point that has not ended yet.
+    ///
+    /// \param args of the profile point, as a JSON object.
+    virtual void unfinishedEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t start_ns, std::string_view args) = 0;
+
+    /// Write a sample of the counter \p name, recorded by thread \p tid.
+    virtual void counterEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t time_ns, double value) = 0;
+
+    /// Write an event without duration, recorded by thread \p tid.
+    ///
+    /// \param scope of the event as in the Trace Event format: 't' marks its
+    /// thread, 'p' its process and 'g' the whole trace.
+    virtual void instantEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t time_ns, char scope) = 0;
+
+    /// Write a step of the flow \p id, attached to the profile point of
+    /// thread \p tid enclosing \p time_ns.
+    ///
+    /// \param phase of the step as in the Trace Event format: 's' starts the
+    /// flow, 't' continues it and 'f' ends it.
+    virtual void flowEvent(std::string_view name, uint32_t pid, int64_t tid, int64_t time_ns, char phase, uint64_t id) = 0;
+
+    /// Write the begin or end of the async span \p id, which does not nest
+    /// with the profile points of the threads.
+    ///
+    /// \param phase of the event as in the Trace Event format: 'b' begins the
+    /// span and 'e' ends it.
+    virtual void asyncEvent(std::string_view name, std::string_view category, uint32_t pid, int64_t tid, int64_t time_ns, char phase,
+                            uint64_t id) = 0;
+
+    /// Write a sample of the call stack of thread \p tid.
+    ///
+    /// \param frames names of the functions on the stack, from the outermost
+    /// call to the sampled one.
+    virtual void sampleEvent(uint32_t pid, int64_t tid, int64_t time_ns, const std::vector<std::string_view> &frames) = 0;
+
+    /// Write the name and order of a process.
+    virtual void processMetadata(uint32_t pid, std::string_view name, int sort_index) = 0;
+
+    /// Write the name and order of a thread.
+    virtual void threadMetadata(uint32_t pid, int64_t tid, std::string_view name, int sort_index) = 0;
+
+    /// Write the buffered events to the file.
+    virtual void flush() = 0;
+
+    /// Create an empty fragment of the trace, buffered in memory.
+    virtual std::unique_ptr<TraceWriter> fragment() = 0;
+
+    /// Append the events written to \p fragment, created by this writer's
+    /// fragment().
+    virtual void append(TraceWriter &fragment) = 0;
+};
+
+} // namespace _profiler
+
+#endif // TRACY_ENABLE
+
+#endif // _TRACE_WRITER_H
@@ -0,0 +1,56 @@
+//===------- dump_benchmark.cpp - Trace serialization benchmark ----------===//
+//
+// Records entries from many threads and measures how long dumping the trace
+// takes. Scaling with the number of serialization workers is measured by
+// running it with different GP_DUMP_THREADS, for instance:
+//
+//   for n in 1 2 4 8 16; do
+//       GP_FILENAME_PREFIX=/tmp/bench GP_DUMP_THREADS=$n RotProfilerBenchmark 64 1000000
+//   done
+//
+// Usage: RotProfilerBenchmark [threads] [entries per thread]
+//
+//===----------------------------------------------------------------------===//
+
+#include <profiler.hpp>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+int main(int argc, char *argv[]) {
+    int threads = argc > 1 ? std::atoi(argv[1]) : 16;
+    int entries = argc > 2 ? std::atoi(argv[2]) : 1000000;
+    if (std::getenv("GP_FILENAME_PREFIX") == nullptr) {
+        std::cerr << "GP_FILENAME_PREFIX must be set for the trace to be dumped\n";
+        return 1;
+    }
+
+    PROF_INIT_PROC("Dump Benchmark");
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++) {
+        workers.emplace_back([i, entries] {
+            PROF_INIT_THD("Worker " + std::to_string(i), i);
+            for (int k = 0; k < entries; k++) {
+                PROF_SCOPED(PROF_LVL_USER, "entry");
+            }
+        });
+    }
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    PROF_DUMP_TRACE();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    const char *dump_threads = std::getenv("GP_DUMP_THREADS");
+    double events = double(threads) * entries;
+    std::cout << "dump threads " << (dump_threads ? dump_threads : "default") << ": " << events << " events in " << elapsed.count()
+              << " s, " << events / elapsed.count() / 1e6 << " M events/s\n";
+    return 0;
+}
@@ -0,0 +1,61 @@
+//===------- record_benchmark.cpp - Profile point recording benchmark -----===//
+//
+// Records profile points from a few threads and measures what each one costs
+// the instrumented thread. The cost of the optional measurements is the
+// difference between runs with and without them, for instance:
+//
+//   RotProfilerRecordBenchmark 1 10000000
+//   GP_THREAD_CPU_TIME=1 RotProfilerRecordBenchmark 1 10000000
+//   GP_PERF_COUNTERS=1 RotProfilerRecordBenchmark 1 10000000
+//
+// On a Linux 6.x virtual machine with the steady clock, a profile point takes
+// about 50 ns. GP_THREAD_CPU_TIME adds about 0.2 us, two clock_gettime()
+// system calls. GP_PERF_COUNTERS adds about 0.4 us with the software counters
+// only, and several microseconds per hardware counter when the PMU is
+// virtualized.
+//
+// Usage: RotProfilerRecordBenchmark [threads] [entries per thread]
+//
+//===----------------------------------------------------------------------===//
+
+#include <profiler.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+int main(int argc, char *argv[]) {
+    int threads = argc > 1 ? std::atoi(argv[1]) : 1;
+    int entries = argc > 2 ? std::atoi(argv[2]) : 10000000;
+
+    PROF_INIT_PROC("Record Benchmark");
+
+    std::vector<double> elapsed(threads);
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++) {
+        workers.emplace_back([i, entries, &elapsed] {
+            PROF_INIT_THD("Worker " + std::to_string(i), i);
+            auto start = std::chrono::steady_clock::now();
+            for (int k = 0; k < entries; k++) {
+                PROF_SCOPED(PROF_LVL_USER, "entry");
+            }
+            elapsed[i] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        });
+    }
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+
+    double slowest = 0;
+    for (double seconds : elapsed) {
+        slowest = std::max(slowest, seconds);
+    }
+    _profiler::BufferStats stats = _profiler::getBufferStats();
+    std::cout << threads << " threads: " << slowest / entries * 1e9 << " ns per profile point, " << double(stats.bytes) / double(stats.entries)
+              << " bytes per entry, " << stats.dropped << " entries dropped\n";
+    return 0;
+}
@@ -0,0 +1,56 @@
+//===------- trace_converter.cpp - Binary to Chrome trace converter ------===//
+//
+// Converts a binary trace dumped with GP_TRACE_FORMAT=binary into the Chrome
+// Trace Event JSON format, or into the Perfetto format when the output ends
+// with ".pftrace". Both files may have a compression extension.
+//
+// Usage: RotProfilerConverter <trace.rptrace> [trace.json|trace.pftrace]
+//
+//===----------------------------------------------------------------------===//
+
+#include "binary_trace.hpp"
+#include "chrome_trace_writer.hpp"
+#include "perfetto_trace_writer.hpp"
+
+#include <iostream>
+#include <memory>
+#include <string>
+
+int main(int argc, char *argv[]) {
+    if (argc < 2 || argc > 3) {
+        std::cerr << "Usage: " << argv[0] << " <trace" << _profiler::binary_trace_extension << "> [trace.json|trace"
+                  << _profiler::perfetto_trace_extension << "]\n";
+        return 1;
+    }
+
+    // By default, the output replaces the extensions of the input.
+    std::string input = argv[1];
+    std::string output;
+    if (argc == 3) {
+        output = argv[2];
+    } else {
+        std::string_view name = _profiler::withoutCompressionExtension(input);
+        size_t extension = name.rfind('.');
+        size_t directory = name.find_last_of("/\\");
+        if (extension == std::string::npos || (directory != std::string::npos && extension < directory)) {
+            extension = name.size();
+        }
+        output = std::string(name.substr(0, extension)) + ".json";
+    }
+
+    std::unique_ptr<_profiler::TraceWriter> writer;
+    if (_profiler::withoutCompressionExtension(output).ends_with(_profiler::perfetto_trace_extension)) {
+        writer = std::make_unique<_profiler::PerfettoTraceWriter>(output);
+    } else {
+        writer = std::make_unique<_profiler::ChromeTraceWriter>(output);
+    }
+    if (!writer->isOpen()) {
+        std::cerr << "Could not open " << output << '\n';
+        return 1;
+    }
+    if (!_profiler::convertBinaryTrace(input, *writer)) {
+        std::cerr << "Could not convert " << input << ", the trace may be truncated\n";
+        return 1;
+    }
+    return 0;
+}